@@ -36,10 +36,12 @@ using namespace llvm;
 
 static cl::opt<bool>
     UseInitialize("acd-use-initialize", cl::init(true), cl::NotHidden,
-                  cl::desc("[AntiClassDump]Inject codes to +initialize"));
+                  cl::desc("[AntiClassDump]Inject codes to +initialize"),
+                  CacheKeyOption());
 static cl::opt<bool>
     RenameMethodIMP("acd-rename-methodimp", cl::init(false), cl::NotHidden,
-                    cl::desc("[AntiClassDump]Rename methods imp"));
+                    cl::desc("[AntiClassDump]Rename methods imp"),
+                    CacheKeyOption());
 namespace llvm {
 struct AntiClassDump : public ModulePass {
   static char ID;
@@ -90,7 +92,8 @@ struct AntiClassDump : public ModulePass {
     return true;
   }
   bool runOnModule(Module &M) override {
-    errs() << "Running AntiClassDump On " << M.getSourceFileName() << "\n";
+    hikariLog(1) << "Running AntiClassDump On " << M.getSourceFileName()
+                 << "\n";
     SmallVector<GlobalVariable *, 32> OLCGVs;
     for (GlobalVariable &GV : M.globals()) {
 #if LLVM_VERSION_MAJOR >= 18
@@ -231,8 +234,8 @@ struct AntiClassDump : public ModulePass {
             cast<GlobalVariable>(CS->getOperand(1)->stripPointerCasts()))
             ->getName();
     SuperClassName = SuperClassName.substr(strlen("OBJC_CLASS_$_"));
-    errs() << "Handling Class:" << ClassName
-           << " With SuperClass:" << SuperClassName << "\n";
+    hikariLog(2) << "Handling Class:" << ClassName
+                 << " With SuperClass:" << SuperClassName << "\n";
 
     // Let's extract stuffs
     // struct _class_t {
@@ -274,16 +277,16 @@ struct AntiClassDump : public ModulePass {
             (selname == "load" && !UseInitialize)) {
           Function *IMPFunc = cast<Function>(readPtrauth(cast<GlobalVariable>(
               methodStruct->getOperand(2)->stripPointerCasts())));
-          errs() << "Found Existing initializer\n";
+          hikariLog(2) << "Found Existing initializer\n";
           EntryBB = &(IMPFunc->getEntryBlock());
         }
       }
     } else {
-      errs() << "Didn't Find ClassMethod List\n";
+      hikariLog(2) << "Didn't Find ClassMethod List\n";
     }
     if (!EntryBB) {
       // We failed to find existing +initializer,create new one
-      errs() << "Creating initializer\n";
+      hikariLog(2) << "Creating initializer\n";
       FunctionType *InitializerType = FunctionType::get(
           Type::getVoidTy(M->getContext()), ArrayRef<Type *>(), false);
       Function *Initializer = Function::Create(
@@ -306,10 +309,12 @@ struct AntiClassDump : public ModulePass {
     ConstantStruct *classCS =
         cast<ConstantStruct>(metaclass_ro->getInitializer());
     if (!metaclassCS->getAggregateElement(5)->isNullValue()) {
-      errs() << "Handling Instance Methods For Class:" << ClassName << "\n";
+      hikariLog(2) << "Handling Instance Methods For Class:" << ClassName
+                   << "\n";
       HandleMethods(metaclassCS, IRB, M, Class, false);
 
-      errs() << "Updating Instance Method Map For Class:" << ClassName << "\n";
+      hikariLog(2) << "Updating Instance Method Map For Class:" << ClassName
+                   << "\n";
       Type *objc_method_type =
           StructType::getTypeByName(M->getContext(), "struct._objc_method");
       ArrayType *AT = ArrayType::get(objc_method_type, 0);
@@ -357,20 +362,20 @@ struct AntiClassDump : public ModulePass {
                                                // allow Null/Undef Value
       methodListGV->dropAllReferences();
       methodListGV->eraseFromParent();
-      errs() << "Updated Instance Method Map of:" << class_ro->getName()
-             << "\n";
+      hikariLog(2) << "Updated Instance Method Map of:" << class_ro->getName()
+                   << "\n";
     }
     // MethodList has index of 5
     // We need to create a new type first then bitcast to required type later
     // Since the original type's contained arraytype has count of 0
     GlobalVariable *methodListGV = nullptr; // is striped MethodListGV
     if (!classCS->getAggregateElement(5)->isNullValue()) {
-      errs() << "Handling Class Methods For Class:" << ClassName << "\n";
+      hikariLog(2) << "Handling Class Methods For Class:" << ClassName << "\n";
       HandleMethods(classCS, IRB, M, Class, true);
       methodListGV = readPtrauth(cast<GlobalVariable>(
           classCS->getAggregateElement(5)->stripPointerCasts()));
     }
-    errs() << "Updating Class Method Map For Class:" << ClassName << "\n";
+    hikariLog(2) << "Updating Class Method Map For Class:" << ClassName << "\n";
     Type *objc_method_type =
         StructType::getTypeByName(M->getContext(), "struct._objc_method");
     ArrayType *AT = ArrayType::get(objc_method_type, 1);
@@ -451,7 +456,8 @@ struct AntiClassDump : public ModulePass {
       methodListGV->dropAllReferences();
       methodListGV->eraseFromParent();
     }
-    errs() << "Updated Class Method Map of:" << class_ro->getName() << "\n";
+    hikariLog(2) << "Updated Class Method Map of:" << class_ro->getName()
+                 << "\n";
     // End ClassCS Handling
   } // handleClass
   void HandleMethods(ConstantStruct *class_ro, IRBuilder<> *IRB, Module *M,
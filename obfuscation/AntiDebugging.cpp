@@ -24,29 +24,47 @@
 #endif
 #include "include/CryptoUtils.h"
 #include "include/Utils.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
-#include "llvm/IRReader/IRReader.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Path.h"
-#include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/raw_ostream.h"
-#include <fstream>
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 using namespace llvm;
 
 static cl::opt<std::string> PreCompiledIRPath(
     "adbextirpath",
     cl::desc("External Path Pointing To Pre-compiled AntiDebugging IR"),
-    cl::value_desc("filename"), cl::init(""));
+    cl::value_desc("filename"), cl::init(""), CacheKeyOption());
 static cl::opt<uint32_t>
     ProbRate("adb_prob",
              cl::desc("Choose the probability [%] For Each Function To Be "
                       "Obfuscated By AntiDebugging"),
-             cl::value_desc("Probability Rate"), cl::init(40), cl::Optional);
+             cl::value_desc("Probability Rate"), cl::init(40), cl::Optional,
+             CacheKeyOption());
+static cl::opt<uint32_t> CheckPeriod(
+    "adb_period",
+    cl::desc("Only run the AntiDebugging check once every N calls of an "
+             "obfuscated function (0 or 1 checks on every call)"),
+    cl::value_desc("Number of Calls"), cl::init(0), cl::Optional,
+    CacheKeyOption());
+static uint32_t CheckPeriodTemp = 0;
+static cl::opt<bool> SkipHotFunctions(
+    "adb_skiphot",
+    cl::desc("Don't insert AntiDebugging checks into functions that profile "
+             "data marks as hot"),
+    cl::init(false), cl::Optional, CacheKeyOption());
+static cl::opt<bool> ExternalHandler(
+    "adb_extern",
+    cl::desc("Call an InitADB provided by a separately linked object instead "
+             "of linking the Pre-compiled AntiDebugging IR into every module"),
+    cl::init(false), cl::Optional, CacheKeyOption());
 
 namespace llvm {
 struct AntiDebugging : public ModulePass {
@@ -76,13 +94,18 @@ struct AntiDebugging : public ModulePass {
         PreCompiledIRPath = Path.c_str();
       }
     }
-    std::ifstream f(PreCompiledIRPath);
-    if (f.good()) {
-      errs() << "Linking PreCompiled AntiDebugging IR From:"
-             << PreCompiledIRPath << "\n";
-      SMDiagnostic SMD;
-      std::unique_ptr<Module> ADBM(
-          parseIRFile(StringRef(PreCompiledIRPath), SMD, M.getContext()));
+    if (ExternalHandler) {
+      M.getOrInsertFunction(
+          "InitADB", FunctionType::get(Type::getVoidTy(M.getContext()), false));
+      this->initialized = true;
+      this->triple = Triple(M.getTargetTriple());
+      return true;
+    }
+    std::unique_ptr<Module> ADBM =
+        loadPrecompiledModule(PreCompiledIRPath, M.getContext());
+    if (ADBM) {
+      hikariLog(1) << "Linking PreCompiled AntiDebugging IR From:"
+                   << PreCompiledIRPath << "\n";
       Linker::linkModules(M, std::move(ADBM), Linker::Flags::LinkOnlyNeeded);
       // FIXME: Mess with GV in ADBCallBack
       Function *ADBCallBack = M.getFunction("ADBCallBack");
@@ -120,12 +143,19 @@ struct AntiDebugging : public ModulePass {
                 "-adb_prob=x must be 0 < x <= 100";
       return false;
     }
+    ProfileSummaryInfo PSI(M);
     for (Function &F : M) {
       if (toObfuscate(flag, &F, "adb") && F.getName() != "ADBCallBack" &&
           F.getName() != "InitADB") {
-        errs() << "Running AntiDebugging On " << F.getName() << "\n";
+        if (SkipHotFunctions &&
+            (F.hasFnAttribute(Attribute::AttrKind::Hot) ||
+             PSI.isFunctionEntryHot(&F)))
+          continue;
+        hikariLog(2) << "Running AntiDebugging On " << F.getName() << "\n";
         if (!this->initialized)
           initialize(M);
+        if (!toObfuscateUint32Option(&F, "adb_period", &CheckPeriodTemp))
+          CheckPeriodTemp = CheckPeriod;
         if (cryptoutils->get_range(100) <= ProbRate)
           runOnFunction(F);
       }
@@ -137,9 +167,42 @@ struct AntiDebugging : public ModulePass {
     // Now operate on Linked AntiDBGCallbacks
     Function *ADBCallBack = F.getParent()->getFunction("ADBCallBack");
     Function *ADBInit = F.getParent()->getFunction("InitADB");
-    if (ADBCallBack && ADBInit) {
-      CallInst::Create(ADBInit, "",
-                       cast<Instruction>(EntryBlock->getFirstInsertionPt()));
+    if (ADBInit && (ADBCallBack || ExternalHandler)) {
+      if (CheckPeriodTemp <= 1) {
+        CallInst::Create(ADBInit, "",
+                         cast<Instruction>(EntryBlock->getFirstInsertionPt()));
+        return true;
+      }
+      // Gate the check behind a per-function call counter so hot callers
+      // don't pay for the handler on every invocation. The counter starts
+      // one short of the period so the very first call is still checked.
+      // Unordered atomics keep the racy update well-defined while lowering
+      // to plain loads and stores.
+      LLVMContext &Context = F.getContext();
+      const DataLayout &DL = F.getParent()->getDataLayout();
+      IntegerType *Int32Ty = Type::getInt32Ty(Context);
+      GlobalVariable *Counter = new GlobalVariable(
+          *F.getParent(), Int32Ty, false,
+          GlobalValue::LinkageTypes::PrivateLinkage,
+          ConstantInt::get(Int32Ty, CheckPeriodTemp - 1), "ADBCounter");
+      BasicBlock::iterator IP = EntryBlock->getFirstInsertionPt();
+      while (isa<AllocaInst>(IP))
+        ++IP;
+      IRBuilder<> IRB(&*IP);
+      LoadInst *Count = IRB.CreateAlignedLoad(Int32Ty, Counter,
+                                              DL.getABITypeAlign(Int32Ty));
+      Count->setAtomic(AtomicOrdering::Unordered);
+      Value *Next = IRB.CreateAdd(Count, ConstantInt::get(Int32Ty, 1));
+      Value *Expired =
+          IRB.CreateICmpUGE(Next, ConstantInt::get(Int32Ty, CheckPeriodTemp));
+      StoreInst *Store = IRB.CreateAlignedStore(
+          IRB.CreateSelect(Expired, ConstantInt::get(Int32Ty, 0), Next),
+          Counter, DL.getABITypeAlign(Int32Ty));
+      Store->setAtomic(AtomicOrdering::Unordered);
+      Instruction *ThenTerm = SplitBlockAndInsertIfThen(
+          Expired, &*IP, false,
+          MDBuilder(Context).createBranchWeights(1, CheckPeriodTemp - 1));
+      CallInst::Create(ADBInit, "", ThenTerm);
     } else {
       errs() << "The ADBCallBack and ADBInit functions were not found\n";
       if (!F.getReturnType()
@@ -148,8 +211,8 @@ struct AntiDebugging : public ModulePass {
                              // is not Void.
         return false;
       if (triple.isOSDarwin() && triple.isAArch64()) {
-        errs() << "Injecting Inline Assembly AntiDebugging For:"
-               << F.getParent()->getTargetTriple() << "\n";
+        hikariLog(2) << "Injecting Inline Assembly AntiDebugging For:"
+                     << F.getParent()->getTargetTriple() << "\n";
         std::string antidebugasm = "";
         switch (cryptoutils->get_range(2)) {
         case 0: {
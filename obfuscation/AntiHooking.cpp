@@ -21,11 +21,9 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
-#include "llvm/IRReader/IRReader.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Path.h"
-#include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/raw_ostream.h"
 #if LLVM_VERSION_MAJOR >= 17
 #include "llvm/ADT/SmallString.h"
@@ -38,7 +36,6 @@
 #include "include/Utils.h"
 #include "include/compat/CallSite.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
-#include <fstream>
 
 // Arm A64 Instruction Set for A-profile architecture 2022-12, Page 56
 #define AARCH64_SIGNATURE_B 0b000101
@@ -53,20 +50,30 @@ static cl::opt<std::string>
     PreCompiledIRPath("adhexrirpath",
                       cl::desc("External Path Pointing To Pre-compiled Anti "
                                "Hooking Handler IR"),
-                      cl::value_desc("filename"), cl::init(""));
+                      cl::value_desc("filename"), cl::init(""),
+                      CacheKeyOption());
+static cl::opt<bool> ExternalHandler(
+    "ah_extern",
+    cl::desc("Call an AHCallBack provided by a separately linked object "
+             "instead of linking the Pre-compiled Anti Hooking IR into every "
+             "module"),
+    cl::init(false), cl::Optional, CacheKeyOption());
 
 static cl::opt<bool> CheckInlineHook("ah_inline", cl::init(true), cl::NotHidden,
-                                     cl::desc("Check Inline Hook for AArch64"));
+                                     cl::desc("Check Inline Hook for AArch64"),
+                                     CacheKeyOption());
 static bool CheckInlineHookTemp = true;
 
 static cl::opt<bool>
     CheckObjectiveCRuntimeHook("ah_objcruntime", cl::init(true), cl::NotHidden,
-                               cl::desc("Check Objective-C Runtime Hook"));
+                               cl::desc("Check Objective-C Runtime Hook"),
+                               CacheKeyOption());
 static bool CheckObjectiveCRuntimeHookTemp = true;
 
 static cl::opt<bool> AntiRebindSymbol("ah_antirebind", cl::init(false),
                                       cl::NotHidden,
-                                      cl::desc("Make fishhook unavailable"));
+                                      cl::desc("Make fishhook unavailable"),
+                                      CacheKeyOption());
 static bool AntiRebindSymbolTemp = false;
 
 namespace llvm {
@@ -98,14 +105,21 @@ struct AntiHook : public ModulePass {
         PreCompiledIRPath = Path.c_str();
       }
     }
-    std::ifstream f(PreCompiledIRPath);
-    if (f.good()) {
-      errs() << "Linking PreCompiled AntiHooking IR From:" << PreCompiledIRPath
-             << "\n";
-      SMDiagnostic SMD;
-      std::unique_ptr<Module> ADBM(
-          parseIRFile(StringRef(PreCompiledIRPath), SMD, M.getContext()));
-      Linker::linkModules(M, std::move(ADBM), Linker::Flags::OverrideFromSrc);
+    if (ExternalHandler) {
+      M.getOrInsertFunction(
+          "AHCallBack",
+          FunctionType::get(Type::getVoidTy(M.getContext()), false));
+      this->initialized = true;
+    } else if (std::unique_ptr<Module> AHM =
+                   loadPrecompiledModule(PreCompiledIRPath, M.getContext())) {
+      hikariLog(1) << "Linking PreCompiled AntiHooking IR From:"
+                   << PreCompiledIRPath << "\n";
+      if (Linker::linkModules(M, std::move(AHM),
+                              Linker::Flags::OverrideFromSrc))
+        errs() << "Failed To Link PreCompiled AntiHooking IR From:"
+               << PreCompiledIRPath << "\n";
+      else
+        this->initialized = true;
     } else {
       errs() << "Failed To Link PreCompiled AntiHooking IR From:"
              << PreCompiledIRPath << "\n";
@@ -149,7 +163,7 @@ struct AntiHook : public ModulePass {
   bool runOnModule(Module &M) override {
     for (Function &F : M) {
       if (toObfuscate(flag, &F, "antihook")) {
-        errs() << "Running AntiHooking On " << F.getName() << "\n";
+        hikariLog(2) << "Running AntiHooking On " << F.getName() << "\n";
         if (!this->initialized)
           initialize(M);
         if (!toObfuscateBoolOption(&F, "ah_inline", &CheckInlineHookTemp))
@@ -97,6 +97,7 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
@@ -111,51 +112,64 @@ static cl::opt<uint32_t>
                 cl::desc("Choose the probability [%] each basic blocks will be "
                          "obfuscated by the -bcf pass"),
                 cl::value_desc("probability rate"), cl::init(defaultObfRate),
-                cl::Optional);
+                cl::Optional, CacheKeyOption());
 static uint32_t ObfProbRateTemp = defaultObfRate;
 
 static cl::opt<uint32_t>
     ObfTimes("bcf_loop",
              cl::desc("Choose how many time the -bcf pass loop on a function"),
              cl::value_desc("number of times"), cl::init(defaultObfTime),
-             cl::Optional);
+             cl::Optional, CacheKeyOption());
 static uint32_t ObfTimesTemp = defaultObfTime;
 
 static cl::opt<uint32_t> ConditionExpressionComplexity(
     "bcf_cond_compl",
     cl::desc("The complexity of the expression used to generate branching "
              "condition"),
-    cl::value_desc("Complexity"), cl::init(3), cl::Optional);
+    cl::value_desc("Complexity"), cl::init(3), cl::Optional, CacheKeyOption());
 static uint32_t ConditionExpressionComplexityTemp = 3;
 
 static cl::opt<bool>
     OnlyJunkAssembly("bcf_onlyjunkasm",
                      cl::desc("only add junk assembly to altered basic block"),
                      cl::value_desc("only add junk assembly"), cl::init(false),
-                     cl::Optional);
+                     cl::Optional, CacheKeyOption());
 static bool OnlyJunkAssemblyTemp = false;
 
 static cl::opt<bool> JunkAssembly(
     "bcf_junkasm",
     cl::desc("Whether to add junk assembly to altered basic block"),
-    cl::value_desc("add junk assembly"), cl::init(false), cl::Optional);
+    cl::value_desc("add junk assembly"), cl::init(false), cl::Optional,
+    CacheKeyOption());
 static bool JunkAssemblyTemp = false;
 
 static cl::opt<uint32_t> MaxNumberOfJunkAssembly(
     "bcf_junkasm_maxnum",
     cl::desc("The maximum number of junk assembliy per altered basic block"),
-    cl::value_desc("max number of junk assembly"), cl::init(4), cl::Optional);
+    cl::value_desc("max number of junk assembly"), cl::init(4), cl::Optional,
+    CacheKeyOption());
 static uint32_t MaxNumberOfJunkAssemblyTemp = 4;
 
 static cl::opt<uint32_t> MinNumberOfJunkAssembly(
     "bcf_junkasm_minnum",
     cl::desc("The minimum number of junk assembliy per altered basic block"),
-    cl::value_desc("min number of junk assembly"), cl::init(2), cl::Optional);
+    cl::value_desc("min number of junk assembly"), cl::init(2), cl::Optional,
+    CacheKeyOption());
 static uint32_t MinNumberOfJunkAssemblyTemp = 2;
 
+static cl::opt<bool> PureAlteredBlock(
+    "bcf_pure",
+    cl::desc("Keep calls, stores and stack allocations out of altered basic "
+             "blocks, so they do not affect inlining, attribute inference or "
+             "alias analysis"),
+    cl::value_desc("side-effect-free altered blocks"), cl::init(false),
+    cl::Optional, CacheKeyOption());
+static bool PureAlteredBlockTemp = false;
+
 static cl::opt<bool> CreateFunctionForOpaquePredicate(
     "bcf_createfunc", cl::desc("Create function for each opaque predicate"),
-    cl::value_desc("create function"), cl::init(false), cl::Optional);
+    cl::value_desc("create function"), cl::init(false), cl::Optional,
+    CacheKeyOption());
 static bool CreateFunctionForOpaquePredicateTemp = false;
 
 static const Instruction::BinaryOps ops[] = {
@@ -239,9 +253,15 @@ struct BogusControlFlow : public FunctionPass {
     // If fla annotations
     if (toObfuscate(flag, &F, "bcf") && !F.isPresplitCoroutine() &&
         !readAnnotationMetadata(&F, "bcfopfunc")) {
-      errs() << "Running BogusControlFlow On " << F.getName() << "\n";
-      bogus(F);
-      doF(F);
+      hikariLog(2) << "Running BogusControlFlow On " << F.getName() << "\n";
+      {
+        TimeTraceScope TimeScope("BogusControlFlow::bogus", F.getName());
+        bogus(F);
+      }
+      {
+        TimeTraceScope TimeScope("BogusControlFlow::doF", F.getName());
+        doF(F);
+      }
     }
 
     return true;
@@ -252,6 +272,8 @@ struct BogusControlFlow : public FunctionPass {
       JunkAssemblyTemp = JunkAssembly;
     if (!toObfuscateBoolOption(&F, "bcf_onlyjunkasm", &OnlyJunkAssemblyTemp))
       OnlyJunkAssemblyTemp = OnlyJunkAssembly;
+    if (!toObfuscateBoolOption(&F, "bcf_pure", &PureAlteredBlockTemp))
+      PureAlteredBlockTemp = PureAlteredBlock;
 
     uint32_t NumObfTimes = ObfTimesTemp;
 
@@ -664,6 +686,8 @@ struct BogusControlFlow : public FunctionPass {
           RemoveDeadConstant(C);
         }
       }
+      if (PureAlteredBlockTemp)
+        makeAlteredBlockPure(alteredBB);
     }
     if (JunkAssemblyTemp || OnlyJunkAssemblyTemp) {
       std::string junk = "";
@@ -674,16 +698,92 @@ struct BogusControlFlow : public FunctionPass {
       InlineAsm *IA = InlineAsm::get(
           FunctionType::get(Type::getVoidTy(alteredBB->getContext()), false),
           junk, "", true, false);
-      if (OnlyJunkAssemblyTemp)
-        CallInst::Create(IA, {}, "", alteredBB);
-      else
-        CallInst::Create(IA, {}, "",
-                         alteredBB->getFirstNonPHIOrDbgOrLifetime());
-      turnOffOptimization(basicBlock->getParent());
+      CallInst *CI =
+          OnlyJunkAssemblyTemp
+              ? CallInst::Create(IA, {}, "", alteredBB)
+              : CallInst::Create(IA, {}, "",
+                                 alteredBB->getFirstNonPHIOrDbgOrLifetime());
+      // The data is never executed, so the call only has to stay where it is
+      // and not cost the rest of the function any optimization. It is kept
+      // alive by sideeffect, claims no memory the IR can see so alias
+      // analysis is unaffected, and nomerge keeps two islands from being
+      // folded into one.
+      CI->setOnlyAccessesInaccessibleMemory();
+      CI->setDoesNotThrow();
+      CI->addFnAttr(Attribute::NoMerge);
     }
     return alteredBB;
   } // end of createAlteredBasicBlock()
 
+  /* makeAlteredBlockPure
+   *
+   * Removes everything from an altered block that the rest of the program
+   * could observe if the block ran: calls other than memory-free intrinsics,
+   * memory writes and allocas. Their results are replaced with loads from a
+   * private global, so the block keeps its shape and data flow. Loads stay,
+   * but lose volatile and atomic semantics.
+   */
+  void makeAlteredBlockPure(BasicBlock *alteredBB) {
+    SmallVector<Instruction *, 16> toRemove;
+    for (Instruction &I : *alteredBB) {
+      if (I.isTerminator())
+        continue;
+      if (LoadInst *LI = dyn_cast<LoadInst>(&I)) {
+        LI->setVolatile(false);
+        LI->setAtomic(AtomicOrdering::NotAtomic);
+        continue;
+      }
+      CallBase *CB = dyn_cast<CallBase>(&I);
+      if (CB && isa<IntrinsicInst>(CB) && !CB->mayHaveSideEffects() &&
+          !CB->mayReadFromMemory())
+        continue;
+      if (CB || I.mayWriteToMemory() || isa<AllocaInst>(&I))
+        toRemove.emplace_back(&I);
+    }
+    for (Instruction *I : toRemove) {
+      if (!I->use_empty())
+        I->replaceAllUsesWith(getPhantomValue(I->getType(), I));
+      I->eraseFromParent();
+    }
+  }
+
+  Value *getPhantomValue(Type *Ty, Instruction *InsertBefore) {
+    if (Ty->isTokenTy())
+      return ConstantTokenNone::get(Ty->getContext());
+    if (!Ty->isSized() || isa<ScalableVectorType>(Ty))
+      return PoisonValue::get(Ty);
+    // A new pass is built for every function, so the stand-in is looked up
+    // in the module: a single byte buffer, grown to fit the largest type
+    Module *M = InsertBefore->getModule();
+    const DataLayout &DL = M->getDataLayout();
+    uint64_t Size = DL.getTypeStoreSize(Ty).getFixedValue();
+    Align Alignment = std::max(DL.getABITypeAlign(Ty), Align(16));
+    GlobalVariable *GV = M->getGlobalVariable("BCFPhantomValue", true);
+    if (!GV || GV->getValueType()->getArrayNumElements() < Size ||
+        GV->getAlign().valueOrOne() < Alignment) {
+      if (GV) {
+        Size = std::max(Size, GV->getValueType()->getArrayNumElements());
+        Alignment = std::max(Alignment, GV->getAlign().valueOrOne());
+      }
+      ArrayType *AT = ArrayType::get(Type::getInt8Ty(M->getContext()), Size);
+      GlobalVariable *NewGV =
+          new GlobalVariable(*M, AT, false, GlobalValue::PrivateLinkage,
+                             Constant::getNullValue(AT), "BCFPhantomValue");
+      NewGV->setAlignment(Alignment);
+      // Nothing ever stores to it, so without this GlobalOpt would fold the
+      // loads to zero and let later passes prove the altered block is UB
+      NewGV->setExternallyInitialized(true);
+      if (GV) {
+        GV->replaceAllUsesWith(NewGV);
+        NewGV->takeName(GV);
+        GV->eraseFromParent();
+      }
+      GV = NewGV;
+    }
+    return new LoadInst(Ty, GV, "", false, DL.getABITypeAlign(Ty),
+                        InsertBefore);
+  }
+
   /* doF
    *
    * This part obfuscate the always true predicates generated in addBogusFlow()
@@ -20,6 +20,7 @@
 #include "include/SubstituteImpl.h"
 #include "include/Utils.h"
 #include "include/compat/CallSite.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
@@ -27,7 +28,9 @@
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/NoFolder.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <tuple>
 #include <unordered_set>
 
 using namespace llvm;
@@ -36,21 +39,22 @@ static cl::opt<bool>
     SubstituteXor("constenc_subxor",
                   cl::desc("Substitute xor operator of ConstantEncryption"),
                   cl::value_desc("Substitute xor operator"), cl::init(false),
-                  cl::Optional);
+                  cl::Optional, CacheKeyOption());
 static bool SubstituteXorTemp = false;
 
 static cl::opt<uint32_t> SubstituteXorProb(
     "constenc_subxor_prob",
     cl::desc(
         "Choose the probability [%] each xor operator will be Substituted"),
-    cl::value_desc("probability rate"), cl::init(40), cl::Optional);
+    cl::value_desc("probability rate"), cl::init(40), cl::Optional,
+    CacheKeyOption());
 static uint32_t SubstituteXorProbTemp = 40;
 
 static cl::opt<bool>
     ConstToGV("constenc_togv",
-              cl::desc("Replace ConstantInt with GlobalVariable"),
+              cl::desc("Replace ConstantInt with XOR-keyed GlobalVariable"),
               cl::value_desc("ConstantInt to GlobalVariable"), cl::init(false),
-              cl::Optional);
+              cl::Optional, CacheKeyOption());
 static bool ConstToGVTemp = false;
 
 static cl::opt<uint32_t>
@@ -58,22 +62,35 @@ static cl::opt<uint32_t>
                   cl::desc("Choose the probability [%] each ConstantInt will "
                            "replaced with GlobalVariable"),
                   cl::value_desc("probability rate"), cl::init(50),
-                  cl::Optional);
+                  cl::Optional, CacheKeyOption());
 static uint32_t ConstToGVProbTemp = 50;
 
 static cl::opt<uint32_t> ObfTimes(
     "constenc_times",
     cl::desc(
         "Choose how many time the ConstantEncryption pass loop on a function"),
-    cl::value_desc("Number of Times"), cl::init(1), cl::Optional);
+    cl::value_desc("Number of Times"), cl::init(1), cl::Optional,
+    CacheKeyOption());
 static uint32_t ObfTimesTemp = 1;
 
+static cl::opt<bool> HoistConstants(
+    "constenc_hoist",
+    cl::desc("Materialize each encrypted ConstantInt once per function in "
+             "the entry block instead of in front of every use"),
+    cl::value_desc("Hoist decoded constants"), cl::init(false), cl::Optional,
+    CacheKeyOption());
+static bool HoistConstantsTemp = false;
+
 namespace llvm {
 struct ConstantEncryption : public ModulePass {
   static char ID;
   bool flag;
   bool dispatchonce;
   std::unordered_set<GlobalVariable *> handled_gvs;
+  // Decoded value of each ConstantInt already materialized in the entry block
+  // of the function being processed. Only used with constenc_hoist.
+  DenseMap<ConstantInt *, Value *> hoisted_consts;
+  Instruction *hoistpt = nullptr;
   ConstantEncryption(bool flag) : ModulePass(ID) { this->flag = flag; }
   ConstantEncryption() : ModulePass(ID) { this->flag = true; }
   bool shouldEncryptConstant(Instruction *I) {
@@ -121,7 +138,7 @@ struct ConstantEncryption : public ModulePass {
     dispatchonce = M.getFunction("dispatch_once");
     for (Function &F : M)
       if (toObfuscate(flag, &F, "constenc") && !F.isPresplitCoroutine()) {
-        errs() << "Running ConstantEncryption On " << F.getName() << "\n";
+        hikariLog(2) << "Running ConstantEncryption On " << F.getName() << "\n";
         FixFunctionConstantExpr(&F);
         if (!toObfuscateUint32Option(&F, "constenc_times", &ObfTimesTemp))
           ObfTimesTemp = ObfTimes;
@@ -129,6 +146,8 @@ struct ConstantEncryption : public ModulePass {
           ConstToGVTemp = ConstToGV;
         if (!toObfuscateBoolOption(&F, "constenc_subxor", &SubstituteXorTemp))
           SubstituteXorTemp = SubstituteXor;
+        if (!toObfuscateBoolOption(&F, "constenc_hoist", &HoistConstantsTemp))
+          HoistConstantsTemp = HoistConstants;
         if (!toObfuscateUint32Option(&F, "constenc_subxor_prob",
                                      &SubstituteXorProbTemp))
           SubstituteXorProbTemp = SubstituteXorProb;
@@ -143,6 +162,9 @@ struct ConstantEncryption : public ModulePass {
           errs() << "-constenc_togv_prob=x must be 0 < x <= 100";
           return false;
         }
+        TimeTraceScope TimeScope("ConstantEncryption::EncryptConstants",
+                                 F.getName());
+        FunctionSeedScope Seed(F);
         uint32_t times = ObfTimesTemp;
         while (times) {
           EncryptConstants(F);
@@ -210,6 +232,14 @@ struct ConstantEncryption : public ModulePass {
   }
 
   void EncryptConstants(Function &F) {
+    hoisted_consts.clear();
+    hoistpt = nullptr;
+    if (HoistConstantsTemp) {
+      BasicBlock::iterator IP = F.getEntryBlock().getFirstInsertionPt();
+      while (isa<AllocaInst>(IP))
+        ++IP;
+      hoistpt = &*IP;
+    }
     for (Instruction &I : instructions(F)) {
       if (!shouldEncryptConstant(&I))
         continue;
@@ -232,6 +262,17 @@ struct ConstantEncryption : public ModulePass {
   void Constant2GlobalVariable(Function &F) {
     Module &M = *F.getParent();
     const DataLayout &DL = M.getDataLayout();
+    // Every replaced constant and stored result of this function lives in one
+    // private i64 array instead of a CToGV global each, which keeps the data
+    // contiguous and the symbol table small. Constants are stored XORed with
+    // a per-slot key and decoded at each use.
+    IntegerType *SlotTy = Type::getInt64Ty(M.getContext());
+    SmallVector<Constant *, 32> PoolInit;
+    SmallVector<ConstantInt *, 32> PoolKeys;
+    SmallVector<BinaryOperator *, 32> Decoders;
+    DenseMap<ConstantInt *, unsigned> ConstSlots;
+    SmallVector<std::tuple<Instruction *, unsigned, unsigned>, 32> ConstUses;
+    SmallVector<std::pair<BinaryOperator *, unsigned>, 16> BOSlots;
     for (Instruction &I : instructions(F)) {
       if (!shouldEncryptConstant(&I))
         continue;
@@ -245,12 +286,29 @@ struct ConstantEncryption : public ModulePass {
         if (ConstantInt *CI = dyn_cast<ConstantInt>(I.getOperand(i))) {
           if (!(cryptoutils->get_range(100) <= ConstToGVProbTemp))
             continue;
-          GlobalVariable *GV = new GlobalVariable(
-              *F.getParent(), CI->getType(), false,
-              GlobalValue::LinkageTypes::PrivateLinkage,
-              ConstantInt::get(CI->getType(), CI->getValue()), "CToGV");
-          appendToCompilerUsed(*F.getParent(), GV);
-          I.setOperand(i, new LoadInst(GV->getValueType(), GV, "", &I));
+          if (CI->getBitWidth() > SlotTy->getBitWidth()) {
+            ConstantInt *Key = ConstantInt::get(
+                M.getContext(), cryptoutils->fillKeys(CI->getType(), 1)[0]);
+            GlobalVariable *GV = new GlobalVariable(
+                M, CI->getType(), false,
+                GlobalValue::LinkageTypes::PrivateLinkage,
+                ConstantInt::get(CI->getType(),
+                                 CI->getValue() ^ Key->getValue()),
+                "CToGV");
+            appendToCompilerUsed(M, GV);
+            LoadInst *LI = new LoadInst(GV->getValueType(), GV, "", &I);
+            Decoders.emplace_back(
+                BinaryOperator::Create(Instruction::Xor, LI, Key, "", &I));
+            I.setOperand(i, Decoders.back());
+            continue;
+          }
+          auto Iter = ConstSlots.find(CI);
+          if (Iter == ConstSlots.end()) {
+            Iter = ConstSlots.insert(std::make_pair(CI, PoolInit.size())).first;
+            PoolInit.emplace_back(
+                ConstantInt::get(SlotTy, CI->getValue().zext(64)));
+          }
+          ConstUses.emplace_back(&I, i, Iter->second);
         }
       }
     }
@@ -262,30 +320,79 @@ struct ConstantEncryption : public ModulePass {
           continue;
         if (!(cryptoutils->get_range(100) <= ConstToGVProbTemp))
           continue;
-        IntegerType *IT = cast<IntegerType>(BO->getType());
-        uint64_t dummy;
-        if (IT == Type::getInt8Ty(IT->getContext()))
-          dummy = cryptoutils->get_uint8_t();
-        else if (IT == Type::getInt16Ty(IT->getContext()))
-          dummy = cryptoutils->get_uint16_t();
-        else if (IT == Type::getInt32Ty(IT->getContext()))
-          dummy = cryptoutils->get_uint32_t();
-        else if (IT == Type::getInt64Ty(IT->getContext()))
-          dummy = cryptoutils->get_uint64_t();
-        else
+        unsigned BitWidth = BO->getType()->getIntegerBitWidth();
+        if (BitWidth < 8 || BitWidth > 64 || !isPowerOf2_32(BitWidth))
           continue;
-        GlobalVariable *GV = new GlobalVariable(
-            M, BO->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
-            ConstantInt::get(BO->getType(), dummy), "CToGV");
-        StoreInst *SI =
-            new StoreInst(BO, GV, false, DL.getABITypeAlign(BO->getType()));
-        SI->insertAfter(BO);
-        LoadInst *LI = new LoadInst(GV->getValueType(), GV, "", false,
-                                    DL.getABITypeAlign(BO->getType()));
-        LI->insertAfter(SI);
-        BO->replaceUsesWithIf(LI, [SI](Use &U) { return U.getUser() != SI; });
+        // Filled with a random dummy below
+        BOSlots.emplace_back(BO, PoolInit.size());
+        PoolInit.emplace_back(nullptr);
+      }
+    }
+    if (PoolInit.empty()) {
+      substituteDecoders(Decoders);
+      return;
+    }
+    // One bulk draw keys every constant slot and seeds every dummy
+    SmallVector<APInt, 16> Keys =
+        cryptoutils->fillKeys(SlotTy, PoolInit.size());
+    PoolKeys.resize(PoolInit.size(), nullptr);
+    for (unsigned Slot = 0; Slot < PoolInit.size(); Slot++) {
+      if (!PoolInit[Slot]) {
+        PoolInit[Slot] = ConstantInt::get(SlotTy, Keys[Slot]);
+        continue;
       }
+      PoolKeys[Slot] = ConstantInt::get(M.getContext(), Keys[Slot]);
+      PoolInit[Slot] = ConstantInt::get(
+          SlotTy, cast<ConstantInt>(PoolInit[Slot])->getValue() ^ Keys[Slot]);
+    }
+    ArrayType *PoolTy = ArrayType::get(SlotTy, PoolInit.size());
+    GlobalVariable *Pool = new GlobalVariable(
+        M, PoolTy, false, GlobalValue::LinkageTypes::PrivateLinkage,
+        ConstantArray::get(PoolTy, PoolInit), "CToGV");
+    appendToCompilerUsed(M, Pool);
+    IntegerType *Int32Ty = Type::getInt32Ty(M.getContext());
+    for (auto &[I, OpIdx, Slot] : ConstUses) {
+      IntegerType *IT = cast<IntegerType>(I->getOperand(OpIdx)->getType());
+      Value *Idx[] = {ConstantInt::get(Int32Ty, 0),
+                      ConstantInt::get(Int32Ty, Slot)};
+      GetElementPtrInst *GEP =
+          GetElementPtrInst::CreateInBounds(PoolTy, Pool, Idx, "", I);
+      LoadInst *LI = new LoadInst(SlotTy, GEP, "", I);
+      Decoders.emplace_back(
+          BinaryOperator::Create(Instruction::Xor, LI, PoolKeys[Slot], "", I));
+      Value *V = Decoders.back();
+      if (IT != SlotTy)
+        V = new TruncInst(V, IT, "", I);
+      I->setOperand(OpIdx, V);
+    }
+    for (auto &[BO, Slot] : BOSlots) {
+      // The slot is always written before it is read, so the narrow store and
+      // load can share the same address regardless of endianness
+      Value *Idx[] = {ConstantInt::get(Int32Ty, 0),
+                      ConstantInt::get(Int32Ty, Slot)};
+      GetElementPtrInst *GEP =
+          GetElementPtrInst::CreateInBounds(PoolTy, Pool, Idx, "");
+      GEP->insertAfter(BO);
+      StoreInst *SI =
+          new StoreInst(BO, GEP, false, DL.getABITypeAlign(BO->getType()));
+      SI->insertAfter(GEP);
+      LoadInst *LI = new LoadInst(BO->getType(), GEP, "", false,
+                                  DL.getABITypeAlign(BO->getType()));
+      LI->insertAfter(SI);
+      BO->replaceUsesWithIf(LI, [SI](Use &U) { return U.getUser() != SI; });
     }
+    substituteDecoders(Decoders);
+  }
+
+  // Substitutes the XORs decoding constant pool slots like the other
+  // constenc paths. They need their users first, as substitution replaces
+  // every use of the original XOR.
+  void substituteDecoders(ArrayRef<BinaryOperator *> Decoders) {
+    if (!SubstituteXorTemp)
+      return;
+    for (BinaryOperator *XORInst : Decoders)
+      if (cryptoutils->get_range(100) <= SubstituteXorProbTemp)
+        SubstituteImpl::substituteXor(XORInst);
   }
 
   void HandleConstantIntInitializerGV(GlobalVariable *GVPtr) {
@@ -343,19 +450,33 @@ struct ConstantEncryption : public ModulePass {
   }
 
   void HandleConstantIntOperand(Instruction *I, unsigned opindex) {
+    ConstantInt *C = cast<ConstantInt>(I->getOperand(opindex));
+    // Allocas in the entry block sit before the hoisting point, so they keep
+    // the per-use decoding
+    bool hoist = hoistpt && !isa<AllocaInst>(I);
+    if (hoist) {
+      auto Iter = hoisted_consts.find(C);
+      if (Iter != hoisted_consts.end()) {
+        I->setOperand(opindex, Iter->second);
+        return;
+      }
+    }
     std::pair<ConstantInt * /*key*/, ConstantInt * /*new*/> keyandnew =
-        PairConstantInt(cast<ConstantInt>(I->getOperand(opindex)));
+        PairConstantInt(C);
     ConstantInt *Key = keyandnew.first;
     ConstantInt *New = keyandnew.second;
     if (!Key || !New)
       return;
-    BinaryOperator *NewOperand =
-        BinaryOperator::Create(Instruction::Xor, New, Key, "", I);
+    BinaryOperator *NewOperand = BinaryOperator::Create(
+        Instruction::Xor, New, Key, "", hoist ? hoistpt : I);
 
     I->setOperand(opindex, NewOperand);
     if (SubstituteXorTemp &&
         cryptoutils->get_range(100) <= SubstituteXorProbTemp)
       SubstituteImpl::substituteXor(NewOperand);
+    // substituteXor RAUWs the xor, so cache whatever the operand now is
+    if (hoist)
+      hoisted_consts[C] = I->getOperand(opindex);
   }
 
   std::pair<ConstantInt * /*key*/, ConstantInt * /*new*/>
@@ -363,21 +484,14 @@ struct ConstantEncryption : public ModulePass {
     if (!C)
       return std::make_pair(nullptr, nullptr);
     IntegerType *IT = cast<IntegerType>(C->getType());
-    uint64_t K;
-    if (IT == Type::getInt1Ty(IT->getContext()) ||
-        IT == Type::getInt8Ty(IT->getContext()))
-      K = cryptoutils->get_uint8_t();
-    else if (IT == Type::getInt16Ty(IT->getContext()))
-      K = cryptoutils->get_uint16_t();
-    else if (IT == Type::getInt32Ty(IT->getContext()))
-      K = cryptoutils->get_uint32_t();
-    else if (IT == Type::getInt64Ty(IT->getContext()))
-      K = cryptoutils->get_uint64_t();
-    else
+    unsigned BitWidth = IT->getBitWidth();
+    if (BitWidth != 1 &&
+        (BitWidth < 8 || BitWidth > 64 || !isPowerOf2_32(BitWidth)))
       return std::make_pair(nullptr, nullptr);
+    APInt K = cryptoutils->fillKeys(IT, 1)[0];
     ConstantInt *CI =
         cast<ConstantInt>(ConstantInt::get(IT, K ^ C->getValue()));
-    return std::make_pair(ConstantInt::get(IT, K), CI);
+    return std::make_pair(ConstantInt::get(IT->getContext(), K), CI);
   }
 };
 
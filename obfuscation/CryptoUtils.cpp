@@ -2,7 +2,10 @@
 // [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
 //===----------------------------------------------------------------------===//
 #include "include/CryptoUtils.h"
+#include "include/Utils.h"
+#include "llvm/IR/DerivedTypes.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include <chrono>
 
@@ -12,15 +15,24 @@ ManagedStatic<CryptoUtils> cryptoutils;
 }
 CryptoUtils::CryptoUtils() {}
 
-uint32_t CryptoUtils::scramble32(
-    uint32_t in, std::unordered_map<uint32_t /*IDX*/, uint32_t /*VAL*/> &VMap) {
-  if (VMap.find(in) == VMap.end()) {
-    uint32_t V = get_uint32_t();
-    VMap[in] = V;
-    return V;
-  } else {
-    return VMap[in];
+CryptoUtils::ScrambleKey CryptoUtils::get_scramble_key() {
+  ScrambleKey Key;
+  for (uint32_t &K : Key.Rounds)
+    K = get_uint32_t();
+  return Key;
+}
+uint32_t CryptoUtils::scramble32(uint32_t in, const ScrambleKey &Key) {
+  // Each round only xors a function of R into L, so the network is invertible
+  // whatever the round function is
+  uint32_t L = in >> 16, R = in & 0xFFFF;
+  for (uint32_t K : Key.Rounds) {
+    uint32_t F = (R ^ K) * 0x45D9F3BU;
+    F ^= F >> 16;
+    uint32_t T = R;
+    R = (L ^ F) & 0xFFFF;
+    L = T;
   }
+  return (L << 16) | R;
 }
 CryptoUtils::~CryptoUtils() {
   if (eng != nullptr)
@@ -31,15 +43,24 @@ void CryptoUtils::prng_seed() {
   std::uint_fast64_t ms =
       duration_cast<milliseconds>(system_clock::now().time_since_epoch())
           .count();
-  errs() << format("std::mt19937_64 seeded with current timestamp: %" PRIu64 "",
-                   ms)
-         << "\n";
+  hikariLog(1) << "std::mt19937_64 seeded with current timestamp: "
+               << format("%" PRIu64, ms) << "\n";
   eng = new std::mt19937_64(ms);
 }
 void CryptoUtils::prng_seed(std::uint_fast64_t seed) {
-  errs() << format("std::mt19937_64 seeded with: %" PRIu64 "", seed) << "\n";
+  hikariLog(1) << format("std::mt19937_64 seeded with: %" PRIu64 "", seed)
+               << "\n";
+  eng = new std::mt19937_64(seed);
+}
+void CryptoUtils::push_seed(std::uint_fast64_t seed) {
+  saved.emplace_back(eng);
   eng = new std::mt19937_64(seed);
 }
+void CryptoUtils::pop_seed() {
+  delete eng;
+  eng = saved.back();
+  saved.pop_back();
+}
 std::uint_fast64_t CryptoUtils::get_raw() {
   if (eng == nullptr)
     prng_seed();
@@ -48,6 +69,58 @@ std::uint_fast64_t CryptoUtils::get_raw() {
 uint32_t CryptoUtils::get_range(uint32_t min, uint32_t max) {
   if (max == 0)
     return 0;
-  std::uniform_int_distribution<uint32_t> dis(min, max - 1);
-  return dis(*eng);
+  // Lemire's multiply-shift with rejection: unbiased, and only divides in
+  // the rare case a draw lands in the biased low part
+  uint32_t range = max - min;
+  uint64_t m = (uint64_t)(uint32_t)get_raw() * range;
+  if ((uint32_t)m < range) {
+    uint32_t t = -range % range;
+    while ((uint32_t)m < t)
+      m = (uint64_t)(uint32_t)get_raw() * range;
+  }
+  return min + (uint32_t)(m >> 32);
+}
+template <typename T>
+static void fillKeysAs(CryptoUtils &C, unsigned BitWidth,
+                       SmallVectorImpl<APInt> &Keys, unsigned N) {
+  SmallVector<T, 64> Words(N);
+  C.fill(MutableArrayRef<T>(Words));
+  for (T W : Words)
+    Keys.emplace_back(APInt(64, W).trunc(BitWidth));
+}
+SmallVector<APInt, 16> CryptoUtils::fillKeys(IntegerType *Ty, unsigned N) {
+  const unsigned BitWidth = Ty->getBitWidth();
+  SmallVector<APInt, 16> Keys;
+  Keys.reserve(N);
+  if (BitWidth <= 8)
+    fillKeysAs<uint8_t>(*this, BitWidth, Keys, N);
+  else if (BitWidth <= 16)
+    fillKeysAs<uint16_t>(*this, BitWidth, Keys, N);
+  else if (BitWidth <= 32)
+    fillKeysAs<uint32_t>(*this, BitWidth, Keys, N);
+  else if (BitWidth <= 64)
+    fillKeysAs<uint64_t>(*this, BitWidth, Keys, N);
+  else {
+    const unsigned NumWords = divideCeil(BitWidth, 64);
+    SmallVector<uint64_t, 64> Words(NumWords * N);
+    fill(MutableArrayRef<uint64_t>(Words));
+    for (unsigned i = 0; i < N; i++)
+      Keys.emplace_back(
+          BitWidth, ArrayRef<uint64_t>(Words).slice(i * NumWords, NumWords));
+  }
+  return Keys;
+}
+void CryptoUtils::get_bernoulli(BitVector &Mask, unsigned N,
+                                uint32_t Percent) {
+  Mask.clear();
+  Mask.resize(N, Percent >= 100);
+  if (Percent == 0 || Percent >= 100)
+    return;
+  uint32_t Threshold = (Percent << 16) / 100;
+  for (unsigned i = 0; i < N; i += 4) {
+    uint64_t W = get_raw();
+    for (unsigned j = 0; j < 4 && i + j < N; j++)
+      if (((W >> (j * 16)) & 0xFFFF) < Threshold)
+        Mask.set(i + j);
+  }
 }
@@ -7,6 +7,7 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Transforms/Utils/LowerSwitch.h"
 
 using namespace llvm;
@@ -32,7 +33,8 @@ bool Flattening::runOnFunction(Function &F) {
   Function *tmp = &F;
   // Do we obfuscate
   if (toObfuscate(flag, tmp, "fla") && !F.isPresplitCoroutine()) {
-    errs() << "Running ControlFlowFlattening On " << F.getName() << "\n";
+    hikariLog(2) << "Running ControlFlowFlattening On " << F.getName() << "\n";
+    TimeTraceScope TimeScope("Flattening::flatten", F.getName());
     flatten(tmp);
   }
 
@@ -48,7 +50,8 @@ void Flattening::flatten(Function *f) {
   const DataLayout &DL = f->getParent()->getDataLayout();
 
   // SCRAMBLER
-  std::unordered_map<uint32_t, uint32_t> scrambling_key;
+  const CryptoUtils::ScrambleKey scrambling_key =
+      cryptoutils->get_scramble_key();
   // END OF SCRAMBLER
 
   PassBuilder PB;
@@ -229,7 +232,7 @@ void Flattening::flatten(Function *f) {
       continue;
     }
   }
-  errs() << "Fixing Stack\n";
+  hikariLog(2) << "Fixing Stack\n";
   fixStack(f);
-  errs() << "Fixed Stack\n";
+  hikariLog(2) << "Fixed Stack\n";
 }
@@ -18,9 +18,11 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
-#include <fstream>
+#include <mutex>
 
 using namespace llvm;
 
@@ -31,15 +33,55 @@ static const int ANDROID32_FLAG = 0x0000 | 0x2;
 static cl::opt<uint64_t>
     dlopen_flag("fco_flag",
                 cl::desc("The value of RTLD_DEFAULT on your platform"),
-                cl::value_desc("value"), cl::init(-1), cl::Optional);
+                cl::value_desc("value"), cl::init(-1), cl::Optional,
+                CacheKeyOption());
 static cl::opt<std::string>
     SymbolConfigPath("fcoconfig",
                      cl::desc("FunctionCallObfuscate Configuration Path"),
-                     cl::value_desc("filename"), cl::init("+-x/"));
+                     cl::value_desc("filename"), cl::init("+-x/"),
+                     CacheKeyOption());
+
+namespace {
+// Symbol configurations are parsed once per process and shared by every
+// module, flattened into a StringMap so lookups by StringRef don't allocate
+struct SymbolConfigCache {
+  std::mutex Lock;
+  StringMap<std::unique_ptr<StringMap<std::string>>> Configs;
+};
+} // namespace
+static ManagedStatic<SymbolConfigCache> symbolConfigCache;
+
+static const StringMap<std::string> *loadSymbolConfig(StringRef Path) {
+  std::lock_guard<std::mutex> Guard(symbolConfigCache->Lock);
+  std::unique_ptr<StringMap<std::string>> &Config =
+      symbolConfigCache->Configs[Path];
+  if (Config)
+    return Config.get();
+  Config = std::make_unique<StringMap<std::string>>();
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+      MemoryBuffer::getFile(Path);
+  if (!BufferOrErr) {
+    errs() << "Failed To Load Symbol Configuration From:" << Path << "\n";
+    return Config.get();
+  }
+  hikariLog(1) << "Loading Symbol Configuration From:" << Path << "\n";
+  nlohmann::json JSON =
+      nlohmann::json::parse((*BufferOrErr)->getBufferStart(),
+                            (*BufferOrErr)->getBufferEnd(), nullptr, false);
+  if (!JSON.is_object()) {
+    errs() << "Invalid Symbol Configuration In:" << Path << "\n";
+    return Config.get();
+  }
+  for (auto &Item : JSON.items())
+    if (Item.value().is_string())
+      Config->try_emplace(Item.key(), Item.value().get<std::string>());
+  return Config.get();
+}
+
 namespace llvm {
 struct FunctionCallObfuscate : public FunctionPass {
   static char ID;
-  nlohmann::json Configuration;
+  const StringMap<std::string> *Configuration;
   bool flag;
   bool initialized;
   bool opaquepointers;
@@ -62,15 +104,7 @@ struct FunctionCallObfuscate : public FunctionPass {
         SymbolConfigPath = Path.c_str();
       }
     }
-    std::ifstream infile(SymbolConfigPath);
-    if (infile.good()) {
-      errs() << "Loading Symbol Configuration From:" << SymbolConfigPath
-             << "\n";
-      infile >> this->Configuration;
-    } else {
-      errs() << "Failed To Load Symbol Configuration From:" << SymbolConfigPath
-             << "\n";
-    }
+    this->Configuration = loadSymbolConfig(SymbolConfigPath);
     this->triple = Triple(M.getTargetTriple());
     if (triple.getVendor() == Triple::VendorType::Apple) {
       Type *Int8PtrTy = Type::getInt8Ty(M.getContext())->getPointerTo();
@@ -256,7 +290,7 @@ struct FunctionCallObfuscate : public FunctionPass {
     // Construct Function Prototypes
     if (!toObfuscate(flag, &F, "fco"))
       return false;
-    errs() << "Running FunctionCallObfuscate On " << F.getName() << "\n";
+    hikariLog(2) << "Running FunctionCallObfuscate On " << F.getName() << "\n";
     Module *M = F.getParent();
     if (!this->initialized)
       initialize(*M);
@@ -314,12 +348,10 @@ struct FunctionCallObfuscate : public FunctionPass {
               calledFunction->isIntrinsic())
             continue;
 
-          if (this->Configuration.find(calledFunction->getName().str()) !=
-              this->Configuration.end()) {
-            std::string sname =
-                this->Configuration[calledFunction->getName().str()]
-                    .get<std::string>();
-            StringRef calledFunctionName = StringRef(sname);
+          auto ConfigIter =
+              this->Configuration->find(calledFunction->getName());
+          if (ConfigIter != this->Configuration->end()) {
+            StringRef calledFunctionName = ConfigIter->getValue();
             BasicBlock *EntryBlock = CS->getParent();
             if (triple.isOSDarwin()) {
               dlopen_flag = DARWIN_FLAG;
@@ -21,14 +21,16 @@ static cl::opt<uint32_t>
     ProbRate("fw_prob",
              cl::desc("Choose the probability [%] For Each CallSite To Be "
                       "Obfuscated By FunctionWrapper"),
-             cl::value_desc("Probability Rate"), cl::init(30), cl::Optional);
+             cl::value_desc("Probability Rate"), cl::init(30), cl::Optional,
+             CacheKeyOption());
 static uint32_t ProbRateTemp = 30;
 
 static cl::opt<uint32_t> ObfTimes(
     "fw_times",
     cl::desc(
         "Choose how many time the FunctionWrapper pass loop on a CallSite"),
-    cl::value_desc("Number of Times"), cl::init(2), cl::Optional);
+    cl::value_desc("Number of Times"), cl::init(2), cl::Optional,
+    CacheKeyOption());
 
 namespace llvm {
 struct FunctionWrapper : public ModulePass {
@@ -41,7 +43,7 @@ struct FunctionWrapper : public ModulePass {
     SmallVector<CallSite *, 16> callsites;
     for (Function &F : M) {
       if (toObfuscate(flag, &F, "fw")) {
-        errs() << "Running FunctionWrapper On " << F.getName() << "\n";
+        hikariLog(2) << "Running FunctionWrapper On " << F.getName() << "\n";
         if (!toObfuscateUint32Option(&F, "fw_prob", &ProbRateTemp))
           ProbRateTemp = ProbRate;
         if (ProbRateTemp > 100) {
@@ -49,6 +51,7 @@ struct FunctionWrapper : public ModulePass {
                     "-fw_prob=x must be 0 < x <= 100";
           return false;
         }
+        FunctionSeedScope Seed(F);
         for (Instruction &Inst : instructions(F))
           if ((isa<CallInst>(&Inst) || isa<InvokeInst>(&Inst)))
             if (cryptoutils->get_range(100) <= ProbRateTemp)
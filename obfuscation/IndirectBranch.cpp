@@ -22,15 +22,27 @@ using namespace llvm;
 
 static cl::opt<bool>
     UseStack("indibran-use-stack", cl::init(true), cl::NotHidden,
-             cl::desc("[IndirectBranch]Stack-based indirect jumps"));
+             cl::desc("[IndirectBranch]Stack-based indirect jumps"),
+             CacheKeyOption());
 static bool UseStackTemp = true;
 
 static cl::opt<bool>
     EncryptJumpTarget("indibran-enc-jump-target", cl::init(false),
                       cl::NotHidden,
-                      cl::desc("[IndirectBranch]Encrypt jump target"));
+                      cl::desc("[IndirectBranch]Encrypt jump target"),
+                      CacheKeyOption());
 static bool EncryptJumpTargetTemp = false;
 
+static cl::opt<uint32_t> InlineThreshold(
+    "indibran-inline-threshold", cl::init(0), cl::NotHidden,
+    cl::desc("[IndirectBranch]Skip functions with fewer instructions than "
+             "this that still have direct call sites, as indirectbr would "
+             "stop them from being inlined, and always_inline functions of "
+             "any size. Scheduling Hikari after the inliner with -hikari_ep "
+             "leaves fewer such call sites. 0 disables it"),
+    CacheKeyOption());
+static uint32_t InlineThresholdTemp = 0;
+
 namespace llvm {
 struct IndirectBranch : public FunctionPass {
   static char ID;
@@ -57,11 +69,29 @@ struct IndirectBranch : public FunctionPass {
 
     SmallVector<Constant *, 32> BBs;
     unsigned long long i = 0;
+    unsigned NotInlinable = 0;
     for (Function &F : M) {
       if (!toObfuscate(flag, &F, "indibr"))
         continue;
-      else
-        to_obf_funcs.insert(&F);
+      if (!toObfuscateUint32Option(&F, "indibran_inline_threshold",
+                                   &InlineThresholdTemp))
+        InlineThresholdTemp = InlineThreshold;
+      if (unsigned CallSites = countInlinableCallSites(F)) {
+        // always_inline callers expect the inliner to succeed
+        if (InlineThresholdTemp > 0 &&
+            (F.hasFnAttribute(Attribute::AlwaysInline) ||
+             F.getInstructionCount() < InlineThresholdTemp)) {
+          hikariLog(2) << "IndirectBranch: Skipping " << F.getName()
+                       << ", which may still be inlined into " << CallSites
+                       << " call sites\n";
+          continue;
+        }
+        hikariLog(2) << "IndirectBranch: " << F.getName()
+                     << " can no longer be inlined into its " << CallSites
+                     << " call sites\n";
+        NotInlinable++;
+      }
+      to_obf_funcs.insert(&F);
       if (!toObfuscateBoolOption(&F, "indibran_use_stack", &UseStackTemp))
         UseStackTemp = UseStack;
 
@@ -72,10 +102,12 @@ struct IndirectBranch : public FunctionPass {
                                  &EncryptJumpTargetTemp))
         EncryptJumpTargetTemp = EncryptJumpTarget;
 
-      if (EncryptJumpTargetTemp)
+      if (EncryptJumpTargetTemp) {
+        FunctionSeedScope Seed(F);
         encmap[&F] = ConstantInt::get(
             Type::getInt32Ty(M.getContext()),
             cryptoutils->get_range(UINT8_MAX, UINT16_MAX * 2) * 4);
+      }
       for (BasicBlock &BB : F)
         if (!BB.isEntryBlock()) {
           indexmap[&BB] = i++;
@@ -90,6 +122,10 @@ struct IndirectBranch : public FunctionPass {
                   : BlockAddress::get(&BB));
         }
     }
+    if (NotInlinable)
+      hikariLog(1) << "IndirectBranch: " << NotInlinable
+                   << " functions can no longer be inlined, see "
+                      "-hikari_verbose=2 and -indibran-inline-threshold\n";
     if (to_obf_funcs.size()) {
       ArrayType *AT = ArrayType::get(
           Type::getInt8Ty(M.getContext())->getPointerTo(), BBs.size());
@@ -103,6 +139,18 @@ struct IndirectBranch : public FunctionPass {
     this->initialized = true;
     return true;
   }
+  // Direct calls to F from other functions that the inliner could take,
+  // which indirectbr would rule out
+  static unsigned countInlinableCallSites(Function &F) {
+    if (F.isInterposable() || F.hasFnAttribute(Attribute::NoInline))
+      return 0;
+    unsigned CallSites = 0;
+    for (User *U : F.users())
+      if (CallBase *CB = dyn_cast<CallBase>(U))
+        if (CB->getCalledOperand() == &F && CB->getFunction() != &F)
+          CallSites++;
+    return CallSites;
+  }
   bool runOnFunction(Function &Func) override {
     Module *M = Func.getParent();
     if (!this->initialized)
@@ -110,7 +158,7 @@ struct IndirectBranch : public FunctionPass {
     if (std::find(to_obf_funcs.begin(), to_obf_funcs.end(), &Func) ==
         to_obf_funcs.end())
       return false;
-    errs() << "Running IndirectBranch On " << Func.getName() << "\n";
+    hikariLog(2) << "Running IndirectBranch On " << Func.getName() << "\n";
     SmallVector<BranchInst *, 32> BIs;
     for (Instruction &Inst : instructions(Func))
       if (BranchInst *BI = dyn_cast<BranchInst>(&Inst))
@@ -207,6 +255,9 @@ struct IndirectBranch : public FunctionPass {
         RealIndex = EncryptJumpTargetTemp ? IRBBI->CreateXor(index, IndexEncKey)
                                           : index;
       }
+      // The tables and keys are never written, but their llvm.compiler.used
+      // entries keep GlobalOpt from marking them constant, so the loads are
+      // not folded back into direct branches under -O2
       Value *LI, *enckeyLoad, *gepptr = nullptr;
       if (UseStackTemp) {
         LoadInst *LILoadFrom =
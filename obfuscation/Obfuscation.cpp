@@ -7,11 +7,22 @@
   Ref : http://lists.llvm.org/pipermail/llvm-dev/2011-February/038109.html
 */
 #include "include/Obfuscation.h"
+#include "include/ObfuscationCache.h"
 #include "include/Utils.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/xxhash.h"
 #include <cstdlib>
+#include <optional>
 
 using namespace llvm;
 
@@ -24,43 +35,80 @@ static cl::opt<uint64_t> AesSeed("aesSeed", cl::init(0x1337),
                                  cl::desc("seed for the PRNG"));
 static cl::opt<bool> EnableAntiClassDump("enable-acdobf", cl::init(false),
                                          cl::NotHidden,
-                                         cl::desc("Enable AntiClassDump."));
+                                         cl::desc("Enable AntiClassDump."),
+                                         CacheKeyOption());
 static cl::opt<bool> EnableAntiHooking("enable-antihook", cl::init(false),
                                        cl::NotHidden,
-                                       cl::desc("Enable AntiHooking."));
+                                       cl::desc("Enable AntiHooking."),
+                                       CacheKeyOption());
 static cl::opt<bool> EnableAntiDebugging("enable-adb", cl::init(false),
                                          cl::NotHidden,
-                                         cl::desc("Enable AntiDebugging."));
+                                         cl::desc("Enable AntiDebugging."),
+                                         CacheKeyOption());
 static cl::opt<bool>
     EnableBogusControlFlow("enable-bcfobf", cl::init(false), cl::NotHidden,
-                           cl::desc("Enable BogusControlFlow."));
+                           cl::desc("Enable BogusControlFlow."),
+                           CacheKeyOption());
 static cl::opt<bool> EnableFlattening("enable-cffobf", cl::init(false),
                                       cl::NotHidden,
-                                      cl::desc("Enable Flattening."));
+                                      cl::desc("Enable Flattening."),
+                                      CacheKeyOption());
 static cl::opt<bool>
     EnableBasicBlockSplit("enable-splitobf", cl::init(false), cl::NotHidden,
-                          cl::desc("Enable BasicBlockSpliting."));
+                          cl::desc("Enable BasicBlockSpliting."),
+                          CacheKeyOption());
 static cl::opt<bool>
     EnableSubstitution("enable-subobf", cl::init(false), cl::NotHidden,
-                       cl::desc("Enable Instruction Substitution."));
+                       cl::desc("Enable Instruction Substitution."),
+                       CacheKeyOption());
 static cl::opt<bool> EnableAllObfuscation("enable-allobf", cl::init(false),
                                           cl::NotHidden,
-                                          cl::desc("Enable All Obfuscation."));
+                                          cl::desc("Enable All Obfuscation."),
+                                          CacheKeyOption());
 static cl::opt<bool> EnableFunctionCallObfuscate(
     "enable-fco", cl::init(false), cl::NotHidden,
-    cl::desc("Enable Function CallSite Obfuscation."));
+    cl::desc("Enable Function CallSite Obfuscation."), CacheKeyOption());
 static cl::opt<bool>
     EnableStringEncryption("enable-strcry", cl::init(false), cl::NotHidden,
-                           cl::desc("Enable String Encryption."));
+                           cl::desc("Enable String Encryption."),
+                           CacheKeyOption());
 static cl::opt<bool>
     EnableConstantEncryption("enable-constenc", cl::init(false), cl::NotHidden,
-                             cl::desc("Enable Constant Encryption."));
+                             cl::desc("Enable Constant Encryption."),
+                             CacheKeyOption());
 static cl::opt<bool>
     EnableIndirectBranching("enable-indibran", cl::init(false), cl::NotHidden,
-                            cl::desc("Enable Indirect Branching."));
+                            cl::desc("Enable Indirect Branching."),
+                            CacheKeyOption());
 static cl::opt<bool>
     EnableFunctionWrapper("enable-funcwra", cl::init(false), cl::NotHidden,
-                          cl::desc("Enable Function Wrapper."));
+                          cl::desc("Enable Function Wrapper."),
+                          CacheKeyOption());
+static cl::opt<std::string> StatsPath(
+    "hikari_stats",
+    cl::desc("Append per-function, per-pass obfuscation statistics as one "
+             "JSON object per module and line. %p expands to the process ID "
+             "and %m to a hash of the module identifier"),
+    cl::value_desc("filename"), cl::init(""));
+enum class HikariEP { None, OptimizerLast, FullLTOLast };
+static cl::opt<HikariEP> AutoRegisterEP(
+    "hikari_ep",
+    cl::desc("Also run the scheduler automatically at a pipeline extension "
+             "point, after inlining and dead code elimination"),
+    cl::values(clEnumValN(HikariEP::None, "none",
+                          "Only run when named in -passes"),
+               clEnumValN(HikariEP::OptimizerLast, "optimizer-last",
+                          "At the end of the per-module optimization "
+                          "pipeline (OptimizerLastEP). With LLVM 20 or newer "
+                          "LTO pre-link runs are skipped and ThinLTO modules "
+                          "are obfuscated in the backend. Older versions "
+                          "cannot tell the phases apart and obfuscate before "
+                          "cross-module inlining. Use full-lto-last for full "
+                          "LTO"),
+               clEnumValN(HikariEP::FullLTOLast, "full-lto-last",
+                          "At the end of the full LTO link-time pipeline "
+                          "(FullLinkTimeOptimizationLastEP)")),
+    cl::init(HikariEP::None), CacheKeyOption());
 // End Obfuscator Options
 
 static void LoadEnv(void) {
@@ -104,6 +152,200 @@ static void LoadEnv(void) {
     EnableAntiDebugging = true;
   }
 }
+namespace {
+// Wall time, instruction/block counts and generated globals of every
+// (function, pass) pair the scheduler runs. Only collected when a JSON report
+// is requested or "hikari" analysis remarks are enabled, in which case each
+// function-level record is also emitted as an optimization remark.
+class PassTelemetry {
+public:
+  struct Record {
+    std::string Pass;
+    std::string Function; // Empty for the module-level summary
+    std::optional<double> WallTime;
+    size_t InstsBefore, InstsAfter;
+    size_t BlocksBefore, BlocksAfter;
+    size_t GlobalsBefore, GlobalsAfter;
+  };
+
+  class Scope {
+  public:
+    Scope(PassTelemetry &T, StringRef Pass, Function *F = nullptr)
+        : Trace(Pass, F ? F->getName() : T.M.getSourceFileName()), T(T),
+          Pass(Pass), F(F) {
+      if (!T.Enabled)
+        return;
+      Globals = T.M.global_size();
+      if (F)
+        Counts[F] = countFunction(*F);
+      else
+        for (Function &Fn : T.M)
+          if (!Fn.isDeclaration())
+            Counts[&Fn] = countFunction(Fn);
+      Start = TimeRecord::getCurrentTime(true);
+    }
+    ~Scope() {
+      if (!T.Enabled)
+        return;
+      double Elapsed = TimeRecord::getCurrentTime(false).getWallTime() -
+                       Start.getWallTime();
+      size_t GlobalsAfter = T.M.global_size();
+      if (F) {
+        T.record(Pass, *F, Elapsed, Counts[F], countFunction(*F), Globals,
+                 GlobalsAfter);
+        return;
+      }
+      // Module passes only know their total time, so per-function records
+      // carry the deltas alone
+      std::pair<size_t, size_t> ModuleBefore(0, 0), ModuleAfter(0, 0);
+      for (Function &Fn : T.M) {
+        if (Fn.isDeclaration())
+          continue;
+        std::pair<size_t, size_t> Before = Counts.lookup(&Fn);
+        std::pair<size_t, size_t> After = countFunction(Fn);
+        ModuleBefore.first += Before.first;
+        ModuleBefore.second += Before.second;
+        ModuleAfter.first += After.first;
+        ModuleAfter.second += After.second;
+        T.record(Pass, Fn, std::nullopt, Before, After, 0, 0);
+      }
+      T.Records.push_back({Pass.str(), "", Elapsed, ModuleBefore.first,
+                           ModuleAfter.first, ModuleBefore.second,
+                           ModuleAfter.second, Globals, GlobalsAfter});
+    }
+
+  private:
+    // Shows up in -ftime-trace output whether or not telemetry is enabled
+    TimeTraceScope Trace;
+    PassTelemetry &T;
+    StringRef Pass;
+    Function *F;
+    size_t Globals = 0;
+    DenseMap<Function *, std::pair<size_t, size_t>> Counts;
+    TimeRecord Start;
+  };
+
+  PassTelemetry(Module &M)
+      : M(M), Remarks(OptimizationRemarkEmitter::allowExtraAnalysis(
+                  M.getContext(), "hikari")),
+        Enabled(Remarks || !StatsPath.empty()) {}
+
+  void emit() {
+    if (!Enabled || StatsPath.empty())
+      return;
+    std::string Path = expandStatsPath();
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_Append | sys::fs::OF_Text);
+    if (EC) {
+      errs() << "Failed To Write Hikari Statistics To:" << Path << ": "
+             << EC.message() << "\n";
+      return;
+    }
+    // Build the whole line first so the locked region is a single write and
+    // parallel compiles sharing one report never interleave
+    std::string Buffer;
+    raw_string_ostream Line(Buffer);
+    json::OStream J(Line);
+    J.object([&] {
+      J.attribute("module", M.getSourceFileName());
+      J.attributeArray("records", [&] {
+        for (const Record &R : Records)
+          J.object([&] {
+            J.attribute("pass", R.Pass);
+            if (!R.Function.empty())
+              J.attribute("function", R.Function);
+            if (R.WallTime)
+              J.attribute("wall_time", *R.WallTime);
+            J.attribute("instructions_before", (int64_t)R.InstsBefore);
+            J.attribute("instructions_after", (int64_t)R.InstsAfter);
+            J.attribute("blocks_before", (int64_t)R.BlocksBefore);
+            J.attribute("blocks_after", (int64_t)R.BlocksAfter);
+            J.attribute("globals_generated",
+                        (int64_t)R.GlobalsAfter - (int64_t)R.GlobalsBefore);
+          });
+      });
+    });
+    Line << "\n";
+    Expected<sys::fs::FileLocker> Lock = OS.lock();
+    if (!Lock) {
+      errs() << "Failed To Lock Hikari Statistics File:" << Path << ": "
+             << toString(Lock.takeError()) << "\n";
+      return;
+    }
+    OS << Buffer;
+    OS.flush();
+  }
+
+private:
+  Module &M;
+  bool Remarks;
+  bool Enabled;
+  std::vector<Record> Records;
+
+  // Same placeholders as -fprofile-generate, so every compile can get its
+  // own report instead of sharing one appended file
+  std::string expandStatsPath() const {
+    std::string Path;
+    StringRef Pattern = StatsPath;
+    for (size_t I = 0; I < Pattern.size(); I++) {
+      if (Pattern[I] != '%' || I + 1 == Pattern.size()) {
+        Path += Pattern[I];
+        continue;
+      }
+      switch (Pattern[++I]) {
+      case 'p':
+        Path += std::to_string(sys::Process::getProcessId());
+        break;
+      case 'm':
+        Path += utohexstr(xxh3_64bits(M.getModuleIdentifier()));
+        break;
+      case '%':
+        Path += '%';
+        break;
+      default:
+        Path += '%';
+        Path += Pattern[I];
+      }
+    }
+    return Path;
+  }
+
+  static std::pair<size_t /*Insts*/, size_t /*Blocks*/>
+  countFunction(Function &F) {
+    size_t Insts = 0;
+    for (BasicBlock &BB : F)
+      Insts += BB.size();
+    return std::make_pair(Insts, F.size());
+  }
+
+  void record(StringRef Pass, Function &F, std::optional<double> WallTime,
+              std::pair<size_t, size_t> Before, std::pair<size_t, size_t> After,
+              size_t GlobalsBefore, size_t GlobalsAfter) {
+    // Passes that left the function alone are not interesting
+    if (Before == After && GlobalsBefore == GlobalsAfter)
+      return;
+    Records.push_back({Pass.str(), F.getName().str(), WallTime, Before.first,
+                       After.first, Before.second, After.second,
+                       GlobalsBefore, GlobalsAfter});
+    if (!Remarks)
+      return;
+    OptimizationRemarkEmitter ORE(&F);
+    ORE.emit([&]() {
+      return OptimizationRemarkAnalysis("hikari", Pass, &F)
+             << Pass << ": instructions "
+             << ore::NV("InstructionsBefore", (unsigned)Before.first) << " -> "
+             << ore::NV("InstructionsAfter", (unsigned)After.first)
+             << ", blocks "
+             << ore::NV("BlocksBefore", (unsigned)Before.second) << " -> "
+             << ore::NV("BlocksAfter", (unsigned)After.second)
+             << ", globals generated "
+             << ore::NV("GlobalsGenerated",
+                        (unsigned)(GlobalsAfter - GlobalsBefore));
+    });
+  }
+};
+} // namespace
+
 namespace llvm {
 struct Obfuscation : public ModulePass {
   static char ID;
@@ -116,73 +358,119 @@ struct Obfuscation : public ModulePass {
   bool runOnModule(Module &M) override {
     if (!EnableIRObfusaction)
       return 0;
+    ObfuscationCache Cache(M, cacheKeyOptions(), AesSeed, AesSeed != 0x1337);
+    if (Cache.load())
+      return true;
+    if (Cache.enabled())
+      cryptoutils->prng_seed(Cache.seed());
+    initFunctionSeeds(AesSeed != 0x1337 ? std::optional<uint64_t>(AesSeed)
+                                        : std::nullopt);
     TimerGroup *tg =
         new TimerGroup("Obfuscation Timer Group", "Obfuscation Timer Group");
     Timer *timer = new Timer("Obfuscation Timer", "Obfuscation Timer", *tg);
     timer->startTimer();
 
-    errs() << "Running Hikari On " << M.getSourceFileName() << "\n";
+    hikariLog(1) << "Running Hikari On " << M.getSourceFileName() << "\n";
+    TimeTraceScope TimeScope("Hikari", M.getSourceFileName());
+    PassTelemetry Telemetry(M);
 
     annotation2Metadata(M);
 
     ModulePass *MP = createAntiHookPass(EnableAntiHooking);
     MP->doInitialization(M);
-    MP->runOnModule(M);
+    {
+      PassTelemetry::Scope S(Telemetry, "AntiHook");
+      MP->runOnModule(M);
+    }
     delete MP;
     // Initial ACD Pass
     if (EnableAllObfuscation || EnableAntiClassDump) {
       ModulePass *P = createAntiClassDumpPass();
       P->doInitialization(M);
-      P->runOnModule(M);
+      {
+        PassTelemetry::Scope S(Telemetry, "AntiClassDump");
+        P->runOnModule(M);
+      }
       delete P;
     }
     // Now do FCO
     FunctionPass *FP = createFunctionCallObfuscatePass(
         EnableAllObfuscation || EnableFunctionCallObfuscate);
     for (Function &F : M)
-      if (!F.isDeclaration())
+      if (!F.isDeclaration()) {
+        PassTelemetry::Scope S(Telemetry, "FunctionCallObfuscate", &F);
+        FunctionSeedScope Seed(F);
         FP->runOnFunction(F);
+      }
     delete FP;
     MP = createAntiDebuggingPass(EnableAntiDebugging);
-    MP->runOnModule(M);
+    {
+      PassTelemetry::Scope S(Telemetry, "AntiDebugging");
+      MP->runOnModule(M);
+    }
     delete MP;
     // Now Encrypt Strings
     MP = createStringEncryptionPass(EnableAllObfuscation ||
                                     EnableStringEncryption);
-    MP->runOnModule(M);
+    {
+      PassTelemetry::Scope S(Telemetry, "StringEncryption");
+      MP->runOnModule(M);
+    }
     delete MP;
     // Now perform Function-Level Obfuscation
     for (Function &F : M)
       if (!F.isDeclaration()) {
+        FunctionSeedScope Seed(F);
         FunctionPass *P = nullptr;
         P = createSplitBasicBlockPass(EnableAllObfuscation ||
                                       EnableBasicBlockSplit);
-        P->runOnFunction(F);
+        {
+          PassTelemetry::Scope S(Telemetry, "SplitBasicBlock", &F);
+          P->runOnFunction(F);
+        }
         delete P;
         P = createBogusControlFlowPass(EnableAllObfuscation ||
                                        EnableBogusControlFlow);
-        P->runOnFunction(F);
+        {
+          PassTelemetry::Scope S(Telemetry, "BogusControlFlow", &F);
+          P->runOnFunction(F);
+        }
         delete P;
         P = createFlatteningPass(EnableAllObfuscation || EnableFlattening);
-        P->runOnFunction(F);
+        {
+          PassTelemetry::Scope S(Telemetry, "Flattening", &F);
+          P->runOnFunction(F);
+        }
         delete P;
         P = createSubstitutionPass(EnableAllObfuscation || EnableSubstitution);
-        P->runOnFunction(F);
+        {
+          PassTelemetry::Scope S(Telemetry, "Substitution", &F);
+          P->runOnFunction(F);
+        }
         delete P;
       }
     MP = createConstantEncryptionPass(EnableConstantEncryption);
-    MP->runOnModule(M);
+    {
+      PassTelemetry::Scope S(Telemetry, "ConstantEncryption");
+      MP->runOnModule(M);
+    }
     delete MP;
-    errs() << "Doing Post-Run Cleanup\n";
+    hikariLog(1) << "Doing Post-Run Cleanup\n";
     FunctionPass *P = createIndirectBranchPass(EnableAllObfuscation ||
                                                EnableIndirectBranching);
     for (Function &F : M)
-      if (!F.isDeclaration())
+      if (!F.isDeclaration()) {
+        PassTelemetry::Scope S(Telemetry, "IndirectBranch", &F);
+        FunctionSeedScope Seed(F);
         P->runOnFunction(F);
+      }
     delete P;
     MP = createFunctionWrapperPass(EnableAllObfuscation ||
                                    EnableFunctionWrapper);
-    MP->runOnModule(M);
+    {
+      PassTelemetry::Scope S(Telemetry, "FunctionWrapper");
+      MP->runOnModule(M);
+    }
     delete MP;
     // Cleanup Flags
     SmallVector<Function *, 8> toDelete;
@@ -201,11 +489,13 @@ struct Obfuscation : public ModulePass {
     for (Function *F : toDelete)
       F->eraseFromParent();
 
+    Cache.store();
     timer->stopTimer();
-    errs() << "Hikari Out\n";
-    errs() << "Spend Time: "
-           << format("%.7f", timer->getTotalTime().getWallTime()) << "s"
-           << "\n";
+    Telemetry.emit();
+    hikariLog(1) << "Hikari Out\n";
+    hikariLog(1) << "Spend Time: "
+                 << format("%.7f", timer->getTotalTime().getWallTime()) << "s"
+                 << "\n";
     tg->clearAll();
     return true;
   } // End runOnModule
@@ -217,13 +507,36 @@ ModulePass *createObfuscationLegacyPass() {
   } else {
     cryptoutils->prng_seed();
   }
-  errs() << "Initializing Hikari Core with Revision ID:" << GIT_COMMIT_HASH
-         << "\n";
+  hikariLog(1) << "Initializing Hikari Core with Revision ID:"
+               << GIT_COMMIT_HASH << "\n";
   return new Obfuscation();
 }
 
+// Set on every obfuscated module. A hikari pass named in -passes combined
+// with -hikari_ep, or OptimizerLastEP firing in both the pre-link and the
+// post-link pipeline, must not obfuscate the module a second time.
+static const char ObfuscatedFlag[] = "hikari.obfuscated";
+
 PreservedAnalyses ObfuscationPass::run(Module &M, ModuleAnalysisManager &MAM) {
+  if (M.getModuleFlag(ObfuscatedFlag)) {
+    hikariLog(1) << "Hikari: " << M.getSourceFileName()
+                 << " is already obfuscated, skipping\n";
+    return PreservedAnalyses::all();
+  }
+  if (deferODRFunctions() && !FullLTOPostLink) {
+    unsigned Deferred = 0;
+    for (Function &F : M)
+      if (!F.isDeclaration() &&
+          (F.hasLinkOnceODRLinkage() || F.hasWeakODRLinkage()))
+        Deferred++;
+    if (Deferred)
+      hikariLog(1) << "Hikari: Warning: -hikari_odr=defer skips " << Deferred
+                   << " linkonce_odr/weak_odr functions, which only a full "
+                      "LTO post-link run (-hikari_ep=full-lto-last) will "
+                      "obfuscate later\n";
+  }
   if (createObfuscationLegacyPass()->runOnModule(M)) {
+    M.addModuleFlag(Module::Max, ObfuscatedFlag, 1);
     return PreservedAnalyses::none();
   }
   return PreservedAnalyses::all();
@@ -292,6 +605,32 @@ PassPluginLibraryInfo getHikariPluginInfo() {
                 return false;
               }
             });
+        // Opt-in automatic scheduling for drivers such as rustc, where a
+        // pass named in -Cpasses runs before inlining and would obfuscate
+        // functions that are later inlined or deleted
+        auto AddAtEP = [](ModulePassManager &MPM, HikariEP EP) {
+          if (AutoRegisterEP != EP)
+            return;
+          EnableIRObfusaction = true;
+          MPM.addPass(ObfuscationPass(EP == HikariEP::FullLTOLast));
+        };
+        PB.registerOptimizerLastEPCallback(
+#if LLVM_VERSION_MAJOR >= 20
+            [AddAtEP](ModulePassManager &MPM, OptimizationLevel,
+                      ThinOrFullLTOPhase Phase) {
+              // Wait for the post-link run, which sees the inlined module
+              if (Phase == ThinOrFullLTOPhase::ThinLTOPreLink ||
+                  Phase == ThinOrFullLTOPhase::FullLTOPreLink)
+                return;
+#else
+            [AddAtEP](ModulePassManager &MPM, OptimizationLevel) {
+#endif
+              AddAtEP(MPM, HikariEP::OptimizerLast);
+            });
+        PB.registerFullLinkTimeOptimizationLastEPCallback(
+            [AddAtEP](ModulePassManager &MPM, OptimizationLevel) {
+              AddAtEP(MPM, HikariEP::FullLTOLast);
+            });
       }};
 }
 
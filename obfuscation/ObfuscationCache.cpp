@@ -0,0 +1,148 @@
+// For open-source license, please refer to
+// [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
+//===----------------------------------------------------------------------===//
+#include "include/ObfuscationCache.h"
+#include "include/Utils.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> CacheDir(
+    "hikari_cache_dir",
+    cl::desc("Directory of the incremental obfuscation cache. Modules whose "
+             "bitcode, configuration, seed and Hikari revision match a "
+             "previous run reuse its result. Entries are keyed per module, "
+             "so changing any function obfuscates the whole module again"),
+    cl::value_desc("directory"), cl::init(""));
+static cl::opt<std::string> CacheSalt(
+    "hikari_cache_salt",
+    cl::desc("Extra string mixed into the obfuscation cache key, for inputs "
+             "Hikari cannot see such as the contents of -fcoconfig or the "
+             "precompiled anti-debugging/anti-hooking IR"),
+    cl::value_desc("salt"), cl::init(""));
+
+ObfuscationCache::ObfuscationCache(Module &M, StringRef Config, uint64_t Seed,
+                                   bool ExplicitSeed)
+    : M(M), Seed(Seed) {
+  if (CacheDir.empty())
+    return;
+  SmallVector<char, 0> Bitcode;
+  raw_svector_ostream OS(Bitcode);
+  WriteBitcodeToFile(M, OS);
+
+  SHA256 Hasher;
+  Hasher.update(ArrayRef<uint8_t>(
+      reinterpret_cast<const uint8_t *>(Bitcode.data()), Bitcode.size()));
+  Hasher.update(StringRef("\0", 1));
+  Hasher.update(Config);
+  Hasher.update(StringRef("\0", 1));
+  Hasher.update(CacheSalt);
+  Hasher.update(StringRef("\0", 1));
+  Hasher.update(GIT_COMMIT_HASH);
+  if (ExplicitSeed) {
+    uint8_t SeedBytes[8];
+    for (unsigned i = 0; i < 8; i++)
+      SeedBytes[i] = (uint8_t)(Seed >> (i * 8));
+    Hasher.update(SeedBytes);
+  }
+  std::array<uint8_t, 32> Digest = Hasher.final();
+  Key = toHex(Digest, true);
+  if (!ExplicitSeed) {
+    this->Seed = 0;
+    for (unsigned i = 0; i < 8; i++)
+      this->Seed |= (uint64_t)Digest[i] << (i * 8);
+  }
+}
+
+static std::string cachePath(StringRef Key) {
+  SmallString<128> Path(CacheDir);
+  sys::path::append(Path, "hikari-" + Key + ".bc");
+  return std::string(Path);
+}
+
+// Removes every global value, comdat, named metadata and module asm from M so
+// that linking the cached module into it reproduces that module exactly. A
+// comdat left behind would make the linker treat the cached members of that
+// comdat as duplicates and drop them.
+static void clearModule(Module &M) {
+  for (Function &F : M)
+    F.dropAllReferences();
+  for (GlobalVariable &GV : M.globals())
+    GV.dropAllReferences();
+  for (GlobalAlias &GA : M.aliases())
+    GA.dropAllReferences();
+  for (GlobalIFunc &GI : M.ifuncs())
+    GI.dropAllReferences();
+  SmallVector<GlobalValue *, 64> GVs;
+  for (GlobalValue &GV : M.global_values())
+    GVs.emplace_back(&GV);
+  for (GlobalValue *GV : GVs)
+    GV->removeDeadConstantUsers();
+  for (GlobalValue *GV : GVs)
+    GV->eraseFromParent();
+  M.getComdatSymbolTable().clear();
+  SmallVector<NamedMDNode *, 8> NMDs;
+  for (NamedMDNode &NMD : M.named_metadata())
+    NMDs.emplace_back(&NMD);
+  for (NamedMDNode *NMD : NMDs)
+    M.eraseNamedMetadata(NMD);
+  M.setModuleInlineAsm("");
+}
+
+bool ObfuscationCache::load() {
+  if (!enabled())
+    return false;
+  std::string Path = cachePath(Key);
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+      MemoryBuffer::getFile(Path);
+  if (!BufferOrErr)
+    return false;
+  Expected<std::unique_ptr<Module>> CachedOrErr =
+      parseBitcodeFile((*BufferOrErr)->getMemBufferRef(), M.getContext());
+  if (!CachedOrErr) {
+    errs() << "Ignoring Corrupted Obfuscation Cache Entry:" << Path << ": "
+           << toString(CachedOrErr.takeError()) << "\n";
+    return false;
+  }
+  clearModule(M);
+  if (Linker::linkModules(M, std::move(*CachedOrErr)))
+    report_fatal_error(Twine("Failed to link obfuscation cache entry ") + Path);
+  hikariLog(1) << "Reused Obfuscation Cache Entry:" << Path << "\n";
+  return true;
+}
+
+void ObfuscationCache::store() {
+  if (!enabled())
+    return;
+  if (std::error_code EC = sys::fs::create_directories(CacheDir.getValue())) {
+    errs() << "Failed To Create Obfuscation Cache Directory:" << CacheDir
+           << ": " << EC.message() << "\n";
+    return;
+  }
+  // Write to a unique temporary and rename it into place, so concurrent
+  // compilations never observe a partially written entry
+  int FD;
+  SmallString<128> TempPath;
+  SmallString<128> Model(CacheDir);
+  sys::path::append(Model, "hikari-%%%%%%%%.tmp");
+  if (std::error_code EC = sys::fs::createUniqueFile(Model, FD, TempPath)) {
+    errs() << "Failed To Write Obfuscation Cache Entry: " << EC.message()
+           << "\n";
+    return;
+  }
+  {
+    raw_fd_ostream OS(FD, true);
+    WriteBitcodeToFile(M, OS);
+  }
+  if (sys::fs::rename(TempPath, cachePath(Key)))
+    sys::fs::remove(TempPath);
+}
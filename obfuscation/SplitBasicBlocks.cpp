@@ -10,7 +10,8 @@
 using namespace llvm;
 
 static cl::opt<uint32_t> SplitNum("split_num", cl::init(2),
-                                  cl::desc("Split <split_num> time each BB"));
+                                  cl::desc("Split <split_num> time each BB"),
+                                  CacheKeyOption());
 static uint32_t SplitNumTemp = 2;
 
 namespace {
@@ -34,7 +35,7 @@ struct SplitBasicBlock : public FunctionPass {
 
     // Do we obfuscate
     if (toObfuscate(flag, &F, "split")) {
-      errs() << "Running BasicBlockSplit On " << F.getName() << "\n";
+      hikariLog(2) << "Running BasicBlockSplit On " << F.getName() << "\n";
       split(&F);
     }
 
@@ -4,11 +4,18 @@
 #include "include/StringEncryption.h"
 #include "include/CryptoUtils.h"
 #include "include/Utils.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/CaptureTracking.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <unordered_set>
@@ -19,9 +26,54 @@ static cl::opt<uint32_t>
     ElementEncryptProb("strcry_prob", cl::init(100), cl::NotHidden,
                        cl::desc("Choose the probability [%] each element of "
                                 "ConstantDataSequential will be "
-                                "obfuscated by the -strcry pass"));
+                                "obfuscated by the -strcry pass"),
+                       CacheKeyOption());
 static uint32_t ElementEncryptProbTemp = 100;
 
+static cl::opt<bool> UseKeystream(
+    "strcry_keystream", cl::init(false), cl::NotHidden,
+    cl::desc("[StringEncryption]Regenerate each string's keys at run time "
+             "from a per-string seed, so only the ciphertext is stored and "
+             "the decrypt space is zero-initialized. Ignores -strcry_prob"),
+    CacheKeyOption());
+static bool UseKeystreamTemp = false;
+
+static cl::opt<uint32_t> StackLimit(
+    "strcry_stack_limit", cl::init(0), cl::NotHidden,
+    cl::desc("[StringEncryption]Decrypt strings of at most this many bytes "
+             "into a stack buffer on every call when the pointer does not "
+             "escape the function, instead of into a writable global. 0 "
+             "disables it"), CacheKeyOption());
+static uint32_t StackLimitTemp = 0;
+
+static cl::opt<uint32_t> TableMinSize(
+    "strcry_table_min", cl::init(0), cl::NotHidden,
+    cl::desc("[StringEncryption]Encrypt integer arrays of at least this many "
+             "bytes in 4 KB chunks, each decrypted on the first access that "
+             "touches it rather than at function entry. 0 disables it"),
+    CacheKeyOption());
+static uint32_t TableMinSizeTemp = 0;
+
+static cl::opt<uint32_t> CompressMinSize(
+    "strcry_compress_min", cl::init(0), cl::NotHidden,
+    cl::desc("[StringEncryption]LZ77-compress byte strings of at least this "
+             "many bytes before encrypting them, when that makes them "
+             "smaller. They are decompressed into a zero-initialized decrypt "
+             "space. 0 disables it"), CacheKeyOption());
+static uint32_t CompressMinSizeTemp = 0;
+
+static cl::opt<bool> SinkColdStrings(
+    "strcry_sink_cold", cl::init(false), cl::NotHidden,
+    cl::desc("[StringEncryption]Decrypt read-only strings that only one "
+             "function uses, and only on paths ending in a noreturn call or "
+             "unreachable such as Rust panic locations, on those paths "
+             "instead of at function entry"),
+    CacheKeyOption());
+static bool SinkColdStringsTemp = false;
+
+// Granularity of chunked tables, in bytes
+static constexpr uint64_t TableChunkSize = 4096;
+
 namespace llvm {
 struct StringEncryption : public ModulePass {
   static char ID;
@@ -33,13 +85,30 @@ struct StringEncryption : public ModulePass {
       encstatus;
   std::unordered_map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
       mgv2keys;
-  std::unordered_map<Constant *, SmallVector<unsigned int, 16>>
-      unencryptedindex;
-  SmallVector<GlobalVariable *, 32> genedgv;
+  // Which elements of each decrypt space were encrypted, see strcry_prob
+  DenseMap<GlobalVariable * /*Decrypt Space*/, BitVector> encryptedmask;
+  DenseSet<GlobalVariable *> genedgv;
+  // Per-chunk decryption status of each chunked table, see strcry_table_min
+  DenseMap<GlobalVariable * /*Decrypt Space*/, GlobalVariable * /*Guards*/>
+      chunkguards;
+  // Decrypt spaces whose every source is a constant, unnamed_addr global, so
+  // the program never writes to them
+  DenseSet<GlobalVariable *> readonlystrings;
+  // Decrypt spaces filled by the string decompressor, see strcry_compress_min
+  DenseSet<GlobalVariable *> compressedstrings;
+  // Helpers created by this pass, which are not encrypted themselves
+  DenseSet<Function *> genedfuncs;
+  Function *decompressor = nullptr;
   std::unordered_map<GlobalVariable *,
                      std::pair<GlobalVariable *, GlobalVariable *>>
       globalOld2New;
   std::unordered_set<GlobalVariable *> globalProcessedGVs;
+  // Encrypted copy of every string content seen so far. Constants are
+  // uniqued, so the initializer itself identifies the content.
+  DenseMap<Constant * /*Initializer*/,
+           std::pair<GlobalVariable * /*encrypted*/,
+                     GlobalVariable * /*decrypt space*/>>
+      stringpool;
   StringEncryption() : ModulePass(ID) { this->flag = true; }
 
   StringEncryption(bool flag) : ModulePass(ID) { this->flag = flag; }
@@ -55,7 +124,7 @@ struct StringEncryption : public ModulePass {
         !(GV->getSection().contains("__objc") &&
           !GV->getSection().contains("array")) &&
         !GV->getName().contains("OBJC") &&
-        std::find(genedgv.begin(), genedgv.end(), GV) == genedgv.end() &&
+        !genedgv.count(GV) &&
         ((GV->getLinkage() == GlobalValue::LinkageTypes::PrivateLinkage ||
           GV->getLinkage() == GlobalValue::LinkageTypes::InternalLinkage) &&
          (flag || AreUsersInOneFunction(GV))))
@@ -74,12 +143,26 @@ struct StringEncryption : public ModulePass {
 #endif
 
     for (Function &F : M)
-      if (toObfuscate(flag, &F, "strenc")) {
-        errs() << "Running StringEncryption On " << F.getName() << "\n";
+      if (!genedfuncs.count(&F) && toObfuscate(flag, &F, "strenc")) {
+        hikariLog(2) << "Running StringEncryption On " << F.getName() << "\n";
 
         if (!toObfuscateUint32Option(&F, "strcry_prob",
                                      &ElementEncryptProbTemp))
           ElementEncryptProbTemp = ElementEncryptProb;
+        if (!toObfuscateBoolOption(&F, "strcry_keystream", &UseKeystreamTemp))
+          UseKeystreamTemp = UseKeystream;
+        if (!toObfuscateUint32Option(&F, "strcry_stack_limit",
+                                     &StackLimitTemp))
+          StackLimitTemp = StackLimit;
+        if (!toObfuscateUint32Option(&F, "strcry_table_min",
+                                     &TableMinSizeTemp))
+          TableMinSizeTemp = TableMinSize;
+        if (!toObfuscateUint32Option(&F, "strcry_compress_min",
+                                     &CompressMinSizeTemp))
+          CompressMinSizeTemp = CompressMinSize;
+        if (!toObfuscateBoolOption(&F, "strcry_sink_cold",
+                                   &SinkColdStringsTemp))
+          SinkColdStringsTemp = SinkColdStrings;
 
         // Check if the number of applications is correct
         if (!((ElementEncryptProbTemp > 0) &&
@@ -94,10 +177,12 @@ struct StringEncryption : public ModulePass {
             M, S->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
             S, "StringEncryptionEncStatus");
         encstatus[&F] = GV;
+        TimeTraceScope TimeScope("StringEncryption::HandleFunction",
+                                 F.getName());
         HandleFunction(&F);
       }
     for (GlobalVariable *GV : globalProcessedGVs) {
-      errs() << "Post-cleaning work: " << GV << "\n";
+      hikariLog(2) << "Post-cleaning work: " << GV << "\n";
       GV->removeDeadConstantUsers();
       if (GV->getNumUses() == 0) {
         GV->dropAllReferences();
@@ -112,8 +197,8 @@ struct StringEncryption : public ModulePass {
   processConstantAggregate(GlobalVariable *strGV, ConstantAggregate *CA,
                            std::unordered_set<GlobalVariable *> *rawStrings,
                            SmallVector<GlobalVariable *, 32> *unhandleablegvs,
-                           SmallVector<GlobalVariable *, 32> *Globals,
-                           std::unordered_set<User *> *Users, bool *breakFor) {
+                           SetVector<GlobalVariable *> *Globals,
+                           std::unordered_set<User *> *Users) {
     for (unsigned i = 0; i < CA->getNumOperands(); i++) {
       Constant *Op = CA->getOperand(i);
       if (GlobalVariable *GV =
@@ -123,14 +208,11 @@ struct StringEncryption : public ModulePass {
           continue;
         }
         Users->insert(opaquepointers ? CA : Op);
-        if (std::find(Globals->begin(), Globals->end(), GV) == Globals->end()) {
-          Globals->emplace_back(GV);
-          *breakFor = true;
-        }
+        Globals->insert(GV);
       } else if (ConstantAggregate *NestedCA =
                      dyn_cast<ConstantAggregate>(Op)) {
         processConstantAggregate(strGV, NestedCA, rawStrings, unhandleablegvs,
-                                 Globals, Users, breakFor);
+                                 Globals, Users);
       } else if (isa<ConstantDataSequential>(Op)) {
         if (CA->getNumOperands() != 1)
           continue;
@@ -140,7 +222,7 @@ struct StringEncryption : public ModulePass {
     }
   }
 
-  void HandleUser(User *U, SmallVector<GlobalVariable *, 32> &Globals,
+  void HandleUser(User *U, SetVector<GlobalVariable *> &Globals,
                   std::unordered_set<User *> &Users,
                   std::unordered_set<User *> &VisitedUsers) {
     VisitedUsers.emplace(U);
@@ -150,7 +232,7 @@ struct StringEncryption : public ModulePass {
         if (User *U2 = dyn_cast<User>(Op))
           Users.insert(U2);
         Users.insert(U);
-        Globals.emplace_back(G);
+        Globals.insert(G);
       } else if (User *U = dyn_cast<User>(Op)) {
         if (!VisitedUsers.count(U))
           HandleUser(U, Globals, Users, VisitedUsers);
@@ -160,7 +242,7 @@ struct StringEncryption : public ModulePass {
 
   void HandleFunction(Function *Func) {
     FixFunctionConstantExpr(Func);
-    SmallVector<GlobalVariable *, 32> Globals;
+    SetVector<GlobalVariable *> Globals;
     std::unordered_set<User *> Users;
     {
       std::unordered_set<User *> VisitedUsers;
@@ -177,58 +259,43 @@ struct StringEncryption : public ModulePass {
                                  GlobalVariable * /*decrypt space*/>>
         old2new;
 
-    auto end = Globals.end();
-    for (auto it = Globals.begin(); it != end; ++it) {
-      end = std::remove(it + 1, end, *it);
-    }
-    Globals.erase(end, Globals.end());
-
     Module *M = Func->getParent();
 
-    SmallVector<GlobalVariable *, 32> transedGlobals, unhandleablegvs;
-
-    do {
-      for (GlobalVariable *GV : Globals) {
-        if (std::find(transedGlobals.begin(), transedGlobals.end(), GV) ==
-            transedGlobals.end()) {
-          bool breakThisFor = false;
-          if (handleableGV(GV)) {
-            if (GlobalVariable *CastedGV = dyn_cast<GlobalVariable>(
-                    GV->getInitializer()->stripPointerCasts())) {
-              if (std::find(Globals.begin(), Globals.end(), CastedGV) ==
-                  Globals.end()) {
-                Globals.emplace_back(CastedGV);
-                ConstantExpr *CE = dyn_cast<ConstantExpr>(GV->getInitializer());
-                Users.insert(CE ? CE : GV->getInitializer());
-                breakThisFor = true;
-              }
-            }
-            if (GV->getInitializer()->getType() ==
-                StructType::getTypeByName(M->getContext(),
-                                          "struct.__NSConstantString_tag")) {
-              objCStrings.insert(GV);
-              rawStrings.insert(cast<GlobalVariable>(
-                  cast<ConstantStruct>(GV->getInitializer())
-                      ->getOperand(2)
-                      ->stripPointerCasts()));
-            } else if (isa<ConstantDataSequential>(GV->getInitializer())) {
-              rawStrings.insert(GV);
-            } else if (ConstantAggregate *CA =
-                           dyn_cast<ConstantAggregate>(GV->getInitializer())) {
-              processConstantAggregate(GV, CA, &rawStrings, &unhandleablegvs,
-                                       &Globals, &Users, &breakThisFor);
-            }
-          } else {
-            unhandleablegvs.emplace_back(GV);
+    SmallVector<GlobalVariable *, 32> unhandleablegvs;
+
+    // Globals doubles as the worklist: globals discovered through
+    // initializers are appended and visited once each, in discovery order
+    for (size_t i = 0; i < Globals.size(); i++) {
+      GlobalVariable *GV = Globals[i];
+      if (handleableGV(GV)) {
+        if (GlobalVariable *CastedGV = dyn_cast<GlobalVariable>(
+                GV->getInitializer()->stripPointerCasts())) {
+          if (Globals.insert(CastedGV)) {
+            ConstantExpr *CE = dyn_cast<ConstantExpr>(GV->getInitializer());
+            Users.insert(CE ? CE : GV->getInitializer());
           }
-          transedGlobals.emplace_back(GV);
-          if (breakThisFor)
-            break;
         }
-      } // foreach loop
-    } while (transedGlobals.size() != Globals.size());
+        if (GV->getInitializer()->getType() ==
+            StructType::getTypeByName(M->getContext(),
+                                      "struct.__NSConstantString_tag")) {
+          objCStrings.insert(GV);
+          rawStrings.insert(
+              cast<GlobalVariable>(cast<ConstantStruct>(GV->getInitializer())
+                                       ->getOperand(2)
+                                       ->stripPointerCasts()));
+        } else if (isa<ConstantDataSequential>(GV->getInitializer())) {
+          rawStrings.insert(GV);
+        } else if (ConstantAggregate *CA =
+                       dyn_cast<ConstantAggregate>(GV->getInitializer())) {
+          processConstantAggregate(GV, CA, &rawStrings, &unhandleablegvs,
+                                   &Globals, &Users);
+        }
+      } else {
+        unhandleablegvs.emplace_back(GV);
+      }
+    }
     for (GlobalVariable *ugv : unhandleablegvs)
-      if (std::find(genedgv.begin(), genedgv.end(), ugv) != genedgv.end()) {
+      if (genedgv.count(ugv)) {
         std::pair<Constant *, GlobalVariable *> mgv2keysval = mgv2keys[ugv];
         if (ugv->getInitializer()->getType() ==
             StructType::getTypeByName(M->getContext(),
@@ -251,13 +318,28 @@ struct StringEncryption : public ModulePass {
         continue;
       auto globalIt = globalOld2New.find(GV);
       if (globalIt != globalOld2New.end()) {
-        errs() << "Found shared global variable: " << GV << "\n";
+        hikariLog(2) << "Found shared global variable: " << GV << "\n";
         old2new[GV] = globalIt->second;
         // 更新当前函数的GV2Keys和mgv2keys
         GV2Keys[globalIt->second.second] = mgv2keys[globalIt->second.second];
         mgv2keys[globalIt->second.second] = GV2Keys[globalIt->second.second];
         continue; // 跳过生成新变量步骤
       }
+      auto PoolIt = stringpool.find(GV->getInitializer());
+      if (PoolIt != stringpool.end() &&
+          canShareString(GV, PoolIt->second.second)) {
+        hikariLog(2) << "Found content-identical global variable: " << GV
+                     << "\n";
+        GlobalVariable *DecryptSpaceGV = PoolIt->second.second;
+        if (GV->getAlign().valueOrOne() >
+            DecryptSpaceGV->getAlign().valueOrOne())
+          DecryptSpaceGV->setAlignment(GV->getAlign());
+        GV2Keys[DecryptSpaceGV] = mgv2keys[DecryptSpaceGV];
+        globalOld2New[GV] = PoolIt->second;
+        globalProcessedGVs.insert(GV);
+        old2new[GV] = PoolIt->second;
+        continue;
+      }
       ConstantDataSequential *CDS =
           dyn_cast<ConstantDataSequential>(GV->getInitializer());
       bool rust_string = !CDS;
@@ -269,124 +351,88 @@ struct StringEncryption : public ModulePass {
         continue;
       }
       IntegerType *intType = cast<IntegerType>(ElementTy);
+      bool Chunked = !rust_string && isChunkedTable(GV, CDS);
+      std::vector<uint8_t> Compressed;
+      if (!rust_string && !Chunked && CompressMinSizeTemp &&
+          intType->getBitWidth() == 8 &&
+          CDS->getNumElements() >= CompressMinSizeTemp &&
+          GV->getAddressSpace() == 0)
+        Compressed = compressString(CDS->getRawDataValues());
       Constant *KeyConst, *EncryptedConst, *DummyConst = nullptr;
-      unencryptedindex[GV] = {};
-      if (intType == Type::getInt8Ty(M->getContext())) {
-        std::vector<uint8_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProbTemp) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint8_t K = cryptoutils->get_uint8_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint8_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint8_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint8_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint8_t>(dummy));
-
-      } else if (intType == Type::getInt16Ty(M->getContext())) {
-        std::vector<uint16_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProbTemp) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint16_t K = cryptoutils->get_uint16_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint16_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint16_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint16_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint16_t>(dummy));
-      } else if (intType == Type::getInt32Ty(M->getContext())) {
-        std::vector<uint32_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProbTemp) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint32_t K = cryptoutils->get_uint32_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint32_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint32_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint32_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint32_t>(dummy));
-      } else if (intType == Type::getInt64Ty(M->getContext())) {
-        std::vector<uint64_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProbTemp) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint64_t K = cryptoutils->get_uint64_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint64_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint64_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint64_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint64_t>(dummy));
-      } else {
+      BitVector Encrypted;
+      switch (intType->getBitWidth()) {
+      case 8:
+        if (!Compressed.empty())
+          encryptCompressed(CDS, Compressed, KeyConst, EncryptedConst,
+                            DummyConst);
+        else
+          encryptElements<uint8_t>(CDS, Chunked, Encrypted, KeyConst,
+                                   EncryptedConst, DummyConst);
+        break;
+      case 16:
+        encryptElements<uint16_t>(CDS, Chunked, Encrypted, KeyConst,
+                                  EncryptedConst, DummyConst);
+        break;
+      case 32:
+        encryptElements<uint32_t>(CDS, Chunked, Encrypted, KeyConst,
+                                  EncryptedConst, DummyConst);
+        break;
+      case 64:
+        encryptElements<uint64_t>(CDS, Chunked, Encrypted, KeyConst,
+                                  EncryptedConst, DummyConst);
+        break;
+      default:
         llvm_unreachable("Unsupported CDS Type");
       }
       // Prepare new rawGV
+      // Ciphertext is only ever read, so it can live in shared read-only pages
       GlobalVariable *EncryptedRawGV = new GlobalVariable(
-          *M, EncryptedConst->getType(), false, GV->getLinkage(),
+          *M, EncryptedConst->getType(), true, GV->getLinkage(),
           EncryptedConst, "EncryptedString", nullptr, GV->getThreadLocalMode(),
           GV->getType()->getAddressSpace());
-      genedgv.emplace_back(EncryptedRawGV);
+      genedgv.insert(EncryptedRawGV);
       GlobalVariable *DecryptSpaceGV;
       if (rust_string) {
+        // Constants are uniqued, so build a new aggregate rather than
+        // rewriting the operand of one that other globals may share
         ConstantAggregate *CA = cast<ConstantAggregate>(GV->getInitializer());
-        CA->setOperand(0, DummyConst);
+        SmallVector<Constant *, 4> Ops;
+        for (unsigned i = 0; i < CA->getNumOperands(); i++)
+          Ops.emplace_back(i == 0 ? DummyConst : CA->getOperand(i));
+        Constant *DecryptInit =
+            isa<ConstantStruct>(CA)
+                ? ConstantStruct::get(cast<StructType>(CA->getType()), Ops)
+                : ConstantArray::get(cast<ArrayType>(CA->getType()), Ops);
         DecryptSpaceGV = new GlobalVariable(
-            *M, GV->getValueType(), false, GV->getLinkage(), CA,
+            *M, GV->getValueType(), false, GV->getLinkage(), DecryptInit,
             "DecryptSpaceRust", nullptr, GV->getThreadLocalMode(),
             GV->getType()->getAddressSpace());
       } else {
         DecryptSpaceGV = new GlobalVariable(
             *M, DummyConst->getType(), false, GV->getLinkage(), DummyConst,
-            "DecryptSpace", nullptr, GV->getThreadLocalMode(),
-            GV->getType()->getAddressSpace());
+            Chunked ? "DecryptSpaceTable" : "DecryptSpace", nullptr,
+            GV->getThreadLocalMode(), GV->getType()->getAddressSpace());
       }
-      genedgv.emplace_back(DecryptSpaceGV);
+      genedgv.insert(DecryptSpaceGV);
+      // Pooled copies are constant and unnamed_addr too, see canShareString
+      if (GV->isConstant() && GV->hasGlobalUnnamedAddr())
+        readonlystrings.insert(DecryptSpaceGV);
+      if (!Compressed.empty())
+        compressedstrings.insert(DecryptSpaceGV);
+      // A chunked table is keyed by its decryptor rather than by a seed
+      if (Chunked)
+        KeyConst = BuildChunkDecryptor(EncryptedRawGV, DecryptSpaceGV,
+                                       cast<ConstantInt>(KeyConst));
       old2new[GV] = std::make_pair(EncryptedRawGV, DecryptSpaceGV);
       GV2Keys[DecryptSpaceGV] = std::make_pair(KeyConst, EncryptedRawGV);
       mgv2keys[DecryptSpaceGV] = GV2Keys[DecryptSpaceGV];
-      unencryptedindex[KeyConst] = unencryptedindex[GV];
+      encryptedmask[DecryptSpaceGV] = std::move(Encrypted);
       globalOld2New[GV] = std::make_pair(EncryptedRawGV, DecryptSpaceGV);
       globalProcessedGVs.insert(GV);
       old2new[GV] = globalOld2New[GV];
+      // The users of a later copy might not qualify for chunking
+      if (!Chunked && GV->isConstant() && GV->hasGlobalUnnamedAddr())
+        stringpool[GV->getInitializer()] = globalOld2New[GV];
     }
     // Now prepare ObjC new GV
     for (GlobalVariable *GV : objCStrings) {
@@ -398,10 +444,10 @@ struct StringEncryption : public ModulePass {
         continue;
       GlobalVariable *EncryptedOCGV = ObjectiveCString(
           GV, "EncryptedStringObjC", old2new[oldrawString].first, CS);
-      genedgv.emplace_back(EncryptedOCGV);
+      genedgv.insert(EncryptedOCGV);
       GlobalVariable *DecryptSpaceOCGV = ObjectiveCString(
           GV, "DecryptSpaceObjC", old2new[oldrawString].second, CS);
-      genedgv.emplace_back(DecryptSpaceOCGV);
+      genedgv.insert(DecryptSpaceOCGV);
       old2new[GV] = std::make_pair(EncryptedOCGV, DecryptSpaceOCGV);
     } // End prepare ObjC new GV
     if (GV2Keys.empty())
@@ -488,6 +534,34 @@ struct StringEncryption : public ModulePass {
     //     toDelete->eraseFromParent();
     //   }
     // }
+    for (auto It = GV2Keys.begin(); It != GV2Keys.end();) {
+      auto Cur = It++;
+      if (Function *Decryptor = dyn_cast<Function>(Cur->second.first)) {
+        HandleChunkedTable(Func, Cur->first, Decryptor);
+        GV2Keys.erase(Cur);
+      }
+    }
+    if (SinkColdStringsTemp)
+      for (auto It = GV2Keys.begin(); It != GV2Keys.end();) {
+        auto Cur = It++;
+        SmallSetVector<BasicBlock *, 4> Blocks;
+        if (!readonlystrings.count(Cur->first) ||
+            !collectColdBlocks(Func, Cur->first, Blocks) ||
+            !isUnsharedString(Cur->first, old2new))
+          continue;
+        HandleColdString(Func, Blocks, Cur->first, Cur->second.first,
+                         Cur->second.second);
+        GV2Keys.erase(Cur);
+      }
+    if (StackLimitTemp)
+      for (auto It = GV2Keys.begin(); It != GV2Keys.end();) {
+        auto Cur = It++;
+        if (HandleStackString(Func, Cur->first, Cur->second.first,
+                              Cur->second.second))
+          GV2Keys.erase(Cur);
+      }
+    if (GV2Keys.empty())
+      return;
     GlobalVariable *StatusGV = encstatus[Func];
     /*
        - Split Original EntryPoint BB into A and C.
@@ -529,6 +603,172 @@ struct StringEncryption : public ModulePass {
     SI->setAtomic(AtomicOrdering::Release); // Release the lock acquired in LI
   } // End of HandleFunction
 
+  // xorshift64, regenerated by the loop HandleDecryptionBlock emits for
+  // keystream strings
+  static uint64_t nextKeystreamState(uint64_t State) {
+    State ^= State << 13;
+    State ^= State >> 7;
+    State ^= State << 17;
+    return State;
+  }
+
+  // Emits one step of nextKeystreamState
+  static Value *CreateKeystreamStep(IRBuilder<> &IRB, Value *State) {
+    Value *Next = IRB.CreateXor(State, IRB.CreateShl(State, 13));
+    Next = IRB.CreateXor(Next, IRB.CreateLShr(Next, 7));
+    return IRB.CreateXor(Next, IRB.CreateShl(Next, 17));
+  }
+
+  // Keystream seed of one chunk of a chunked table, so every chunk can be
+  // decrypted on its own
+  static uint64_t chunkSeed(uint64_t Seed, uint64_t Chunk) {
+    return (Seed ^ ((Chunk + 1) * 0x9E3779B97F4A7C15ULL)) | 1;
+  }
+
+  // Read-only literals whose address is not significant can share one
+  // decrypt space
+  static bool canShareString(GlobalVariable *GV, GlobalVariable *DecryptSpace) {
+    return GV->isConstant() && GV->hasGlobalUnnamedAddr() &&
+           GV->getThreadLocalMode() == DecryptSpace->getThreadLocalMode() &&
+           GV->getAddressSpace() == DecryptSpace->getAddressSpace();
+  }
+
+  // Only arrays that are reached from instructions alone can be chunked. A
+  // pointer stored in another global could be dereferenced anywhere, without
+  // going through a chunk check.
+  bool isChunkedTable(GlobalVariable *GV, ConstantDataSequential *CDS) {
+    if (!TableMinSizeTemp || !isa<ConstantDataArray>(CDS) ||
+        GV->isThreadLocal() ||
+        (uint64_t)CDS->getNumElements() * CDS->getElementByteSize() <
+            TableMinSizeTemp)
+      return false;
+    for (User *U : GV->users()) {
+      if (isa<Instruction>(U))
+        continue;
+      if (!isa<ConstantExpr>(U) || !all_of(U->users(), [](User *U2) {
+            return isa<Instruction>(U2);
+          }))
+        return false;
+    }
+    return true;
+  }
+
+  // Encrypts each element of CDS with probability ElementEncryptProbTemp%.
+  // Keys, dummies and the sampling mask are drawn in bulk. Elements left in
+  // plaintext get a key of 1 and keep their value in the decrypt space.
+  // In keystream mode KeyConst is the i64 seed instead of a key array.
+  // Chunked tables restart the keystream at every chunk.
+  template <typename T>
+  void encryptElements(ConstantDataSequential *CDS, bool Chunked,
+                       BitVector &Encrypt, Constant *&KeyConst,
+                       Constant *&EncryptedConst, Constant *&DummyConst) {
+    unsigned N = CDS->getNumElements();
+    LLVMContext &Ctx = CDS->getContext();
+    if (UseKeystreamTemp || Chunked) {
+      const uint64_t PerChunk = TableChunkSize / sizeof(T);
+      uint64_t Seed = cryptoutils->get_uint64_t() | 1, State = Seed;
+      std::vector<T> encry(N);
+      for (unsigned i = 0; i < N; i++) {
+        if (Chunked && i % PerChunk == 0)
+          State = chunkSeed(Seed, i / PerChunk);
+        State = nextKeystreamState(State);
+        encry[i] = static_cast<T>(CDS->getElementAsInteger(i) ^ State);
+      }
+      KeyConst = ConstantInt::get(Type::getInt64Ty(Ctx), Seed);
+      EncryptedConst = ConstantDataArray::get(Ctx, ArrayRef<T>(encry));
+      DummyConst = Constant::getNullValue(EncryptedConst->getType());
+      return;
+    }
+    cryptoutils->get_bernoulli(Encrypt, N, ElementEncryptProbTemp);
+    std::vector<T> keys(N), dummy(N), encry;
+    cryptoutils->fill(MutableArrayRef<T>(keys));
+    cryptoutils->fill(MutableArrayRef<T>(dummy));
+    encry.reserve(Encrypt.count());
+    for (unsigned i = 0; i < N; i++) {
+      const T V = CDS->getElementAsInteger(i);
+      if (!Encrypt[i]) {
+        keys[i] = 1;
+        dummy[i] = V;
+        continue;
+      }
+      encry.emplace_back(keys[i] ^ V);
+    }
+    KeyConst = ConstantDataArray::get(Ctx, ArrayRef<T>(keys));
+    EncryptedConst = ConstantDataArray::get(Ctx, ArrayRef<T>(encry));
+    DummyConst = ConstantDataArray::get(Ctx, ArrayRef<T>(dummy));
+  }
+
+  // Greedy LZ77 over a 64 KB window. Each sequence is a literal count, that
+  // many literal bytes, then a match length that is either 0 or followed by
+  // a little-endian 16-bit distance. Counts and lengths fit in one byte, which
+  // keeps the decompressor HandleStringDecryption calls small. Returns an
+  // empty vector unless the result is smaller than the input.
+  static std::vector<uint8_t> compressString(StringRef In) {
+    const size_t N = In.size();
+    const uint8_t *Data = In.bytes_begin();
+    std::vector<uint8_t> Out;
+    std::vector<int64_t> Table(1 << 12, -1);
+    size_t Anchor = 0, i = 0;
+    auto read32 = [Data](size_t Pos) {
+      return (uint32_t)Data[Pos] | (uint32_t)Data[Pos + 1] << 8 |
+             (uint32_t)Data[Pos + 2] << 16 | (uint32_t)Data[Pos + 3] << 24;
+    };
+    auto emit = [&](size_t LiteralEnd, size_t MatchLen, size_t Distance) {
+      while (LiteralEnd - Anchor > 255) {
+        Out.emplace_back(255);
+        Out.insert(Out.end(), Data + Anchor, Data + Anchor + 255);
+        Out.emplace_back(0);
+        Anchor += 255;
+      }
+      Out.emplace_back(LiteralEnd - Anchor);
+      Out.insert(Out.end(), Data + Anchor, Data + LiteralEnd);
+      Out.emplace_back(MatchLen);
+      if (MatchLen) {
+        Out.emplace_back(Distance & 0xFF);
+        Out.emplace_back(Distance >> 8);
+      }
+    };
+    while (i + 4 <= N && Out.size() < N) {
+      uint32_t V = read32(i);
+      uint32_t Hash = (V * 2654435761U) >> 20;
+      int64_t Candidate = Table[Hash];
+      Table[Hash] = i;
+      if (Candidate < 0 || i - Candidate > 0xFFFF || read32(Candidate) != V) {
+        i++;
+        continue;
+      }
+      size_t Len = 4;
+      while (i + Len < N && Len < 255 && Data[Candidate + Len] == Data[i + Len])
+        Len++;
+      emit(i, Len, i - Candidate);
+      i += Len;
+      Anchor = i;
+    }
+    if (Anchor < N)
+      emit(N, 0, 0);
+    if (Out.size() >= N)
+      Out.clear();
+    return Out;
+  }
+
+  // Encrypts the compressed form of CDS with a keystream. The decompressor
+  // decrypts it byte by byte as it parses it, so no plaintext copy of the
+  // compressed data ever exists in memory.
+  void encryptCompressed(ConstantDataSequential *CDS,
+                         ArrayRef<uint8_t> Compressed, Constant *&KeyConst,
+                         Constant *&EncryptedConst, Constant *&DummyConst) {
+    LLVMContext &Ctx = CDS->getContext();
+    uint64_t Seed = cryptoutils->get_uint64_t() | 1, State = Seed;
+    std::vector<uint8_t> encry(Compressed.size());
+    for (size_t i = 0; i < Compressed.size(); i++) {
+      State = nextKeystreamState(State);
+      encry[i] = Compressed[i] ^ (uint8_t)State;
+    }
+    KeyConst = ConstantInt::get(Type::getInt64Ty(Ctx), Seed);
+    EncryptedConst = ConstantDataArray::get(Ctx, ArrayRef<uint8_t>(encry));
+    DummyConst = Constant::getNullValue(CDS->getType());
+  }
+
   GlobalVariable *ObjectiveCString(GlobalVariable *GV, std::string name,
                                    GlobalVariable *newString,
                                    ConstantStruct *CS) {
@@ -586,56 +826,611 @@ struct StringEncryption : public ModulePass {
       std::unordered_map<GlobalVariable *,
                          std::pair<Constant *, GlobalVariable *>> &GV2Keys) {
     IRBuilder<> IRB(B);
-    Value *zero = ConstantInt::get(Type::getInt32Ty(B->getContext()), 0);
     for (std::unordered_map<GlobalVariable *,
                             std::pair<Constant *, GlobalVariable *>>::iterator
              iter = GV2Keys.begin();
-         iter != GV2Keys.end(); ++iter) {
-      bool rust_string =
-          !isa<ConstantDataSequential>(iter->first->getInitializer());
-      ConstantAggregate *CA =
-          rust_string ? cast<ConstantAggregate>(iter->first->getInitializer())
-                      : nullptr;
-      Constant *KeyConst = iter->second.first;
-      ConstantDataArray *CastedCDA = cast<ConstantDataArray>(KeyConst);
-      // Prevent optimization of encrypted data
-      appendToCompilerUsed(*iter->second.second->getParent(),
-                           {iter->second.second});
-      // Element-By-Element XOR so the fucking verifier won't complain
-      // Also, this hides keys
-      uint64_t realkeyoff = 0;
-      for (uint64_t i = 0; i < CastedCDA->getType()->getNumElements(); i++) {
-        if (unencryptedindex[KeyConst].size() &&
-            std::find(unencryptedindex[KeyConst].begin(),
-                      unencryptedindex[KeyConst].end(),
-                      i) != unencryptedindex[KeyConst].end())
+         iter != GV2Keys.end(); ++iter)
+      HandleStringDecryption(IRB, C, iter->first, iter->second.first,
+                             iter->second.second);
+    IRB.CreateBr(C);
+  } // End of HandleDecryptionBlock
+
+  // Emits the decryption of one string at IRB, which is left after it. C is
+  // the block the emitted code falls through to.
+  void HandleStringDecryption(IRBuilder<> &IRB, BasicBlock *C,
+                              GlobalVariable *DecryptSpace, Constant *KeyConst,
+                              GlobalVariable *EncryptedGV) {
+    Value *zero = ConstantInt::get(Type::getInt32Ty(C->getContext()), 0);
+    // Plain decrypt spaces are integer arrays, Rust ones wrap the array
+    Type *DecryptTy = DecryptSpace->getValueType();
+    bool rust_string = !(isa<ArrayType>(DecryptTy) &&
+                         DecryptTy->getArrayElementType()->isIntegerTy());
+    Type *RustInnerTy = rust_string ? DecryptTy->getContainedType(0) : nullptr;
+    // Prevent optimization of encrypted data
+    appendToCompilerUsed(*EncryptedGV->getParent(), {EncryptedGV});
+    if (compressedstrings.count(DecryptSpace)) {
+      uint64_t Size =
+          cast<ArrayType>(EncryptedGV->getValueType())->getNumElements();
+      IRB.CreateCall(GetStringDecompressor(*DecryptSpace->getParent()),
+                     {EncryptedGV,
+                      ConstantInt::get(Type::getInt64Ty(C->getContext()), Size),
+                      DecryptSpace, KeyConst});
+      return;
+    }
+    if (ConstantInt *Seed = dyn_cast<ConstantInt>(KeyConst)) {
+      // Struct indices have to be i32
+      Value *DecryptedArray =
+          rust_string ? IRB.CreateGEP(DecryptTy, DecryptSpace, {zero, zero})
+                      : DecryptSpace;
+      HandleKeystreamDecryption(IRB, C, Seed, EncryptedGV, DecryptedArray);
+      return;
+    }
+    ConstantDataArray *CastedCDA = cast<ConstantDataArray>(KeyConst);
+    // Element-By-Element XOR so the fucking verifier won't complain
+    // Also, this hides keys
+    uint64_t realkeyoff = 0;
+    for (unsigned i : encryptedmask[DecryptSpace].set_bits()) {
+      Value *offset =
+          ConstantInt::get(Type::getInt64Ty(C->getContext()), realkeyoff);
+      Value *offset2 = ConstantInt::get(Type::getInt64Ty(C->getContext()), i);
+      Value *EncryptedGEP = IRB.CreateGEP(EncryptedGV->getValueType(),
+                                          EncryptedGV, {zero, offset});
+      Value *DecryptedGEP =
+          rust_string
+              ? IRB.CreateGEP(
+                    RustInnerTy,
+                    IRB.CreateGEP(DecryptTy, DecryptSpace, {zero, zero}),
+                    {zero, offset2})
+              : IRB.CreateGEP(DecryptSpace->getValueType(), DecryptSpace,
+                              {zero, offset2});
+      // EncryptedString is created constant, so under -O2 the XOR would
+      // fold into the plaintext. A volatile load keeps it in memory; this
+      // code runs once per status flag.
+      LoadInst *LI = IRB.CreateLoad(CastedCDA->getElementType(), EncryptedGEP,
+                                    true, "EncryptedChar");
+      Value *XORed = IRB.CreateXor(LI, CastedCDA->getElementAsConstant(i));
+      IRB.CreateStore(XORed, DecryptedGEP);
+      realkeyoff++;
+    }
+  }
+
+  // Blocks that can only end in a panic or an abort
+  static bool isColdUse(Instruction *I) {
+    if (CallBase *CB = dyn_cast<CallBase>(I))
+      if (CB->doesNotReturn())
+        return true;
+    return isa<UnreachableInst>(I->getParent()->getTerminator());
+  }
+
+  // Whether no other function uses DecryptSpace, now or once it is
+  // processed. Its sources must be left without users, and it is taken out of
+  // the pool so that later copies of the literal get their own decrypt space.
+  bool isUnsharedString(
+      GlobalVariable *DecryptSpace,
+      std::unordered_map<GlobalVariable *,
+                         std::pair<GlobalVariable *, GlobalVariable *>>
+          &old2new) {
+    SmallVector<GlobalVariable *, 2> Sources;
+    for (auto &Entry : old2new)
+      if (Entry.second.second == DecryptSpace) {
+        Entry.first->removeDeadConstantUsers();
+        if (!Entry.first->use_empty())
+          return false;
+        Sources.emplace_back(Entry.first);
+      }
+    for (GlobalVariable *GV : Sources) {
+      auto PoolIt = stringpool.find(GV->getInitializer());
+      if (PoolIt != stringpool.end() &&
+          PoolIt->second.second == DecryptSpace)
+        stringpool.erase(PoolIt);
+    }
+    return !Sources.empty();
+  }
+
+  // Collects the blocks of Func with instructions that reach DecryptSpace,
+  // directly or through the initializers of other globals like Rust's
+  // core::panic::Location. Fails if any of them is not cold or belongs to
+  // another function.
+  static bool collectColdBlocks(Function *Func, GlobalVariable *DecryptSpace,
+                                SmallSetVector<BasicBlock *, 4> &Blocks) {
+    SmallVector<User *, 16> Worklist(DecryptSpace->users());
+    SmallPtrSet<User *, 16> Visited;
+    while (!Worklist.empty()) {
+      User *U = Worklist.pop_back_val();
+      if (!Visited.insert(U).second)
+        continue;
+      if (Instruction *I = dyn_cast<Instruction>(U)) {
+        if (I->getFunction() != Func)
+          return false;
+        BasicBlock *BB = I->getParent();
+        if (!isColdUse(I) || BB->getFirstInsertionPt() == BB->end())
+          return false;
+        Blocks.insert(BB);
+      } else if (isa<Constant>(U)) {
+        Worklist.append(U->user_begin(), U->user_end());
+      }
+    }
+    return !Blocks.empty();
+  }
+
+  // Decrypts DecryptSpace at the start of each of Blocks instead of at
+  // function entry. Like the entry block, the decryption is guarded by a
+  // status flag, here one per string, so a cold block inside a loop or several
+  // cold blocks sharing the string only decrypt it once.
+  void HandleColdString(Function *Func, SmallSetVector<BasicBlock *, 4> &Blocks,
+                        GlobalVariable *DecryptSpace, Constant *KeyConst,
+                        GlobalVariable *EncryptedGV) {
+    LLVMContext &Ctx = Func->getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    GlobalVariable *StatusGV = new GlobalVariable(
+        *Func->getParent(), Int32Ty, false, GlobalValue::PrivateLinkage,
+        ConstantInt::get(Int32Ty, 0), "StringEncryptionColdStatus");
+    for (BasicBlock *BB : Blocks) {
+      BasicBlock *Rest = BB->splitBasicBlock(BB->getFirstInsertionPt());
+      BasicBlock *Decrypt =
+          BasicBlock::Create(Ctx, "ColdStringDecryption", Func, Rest);
+      BB->getTerminator()->eraseFromParent();
+      IRBuilder<> IRB(BB);
+      LoadInst *LI = IRB.CreateLoad(Int32Ty, StatusGV, "LoadEncryptionStatus");
+      LI->setAtomic(AtomicOrdering::Acquire);
+      LI->setAlignment(Align(4));
+      IRB.CreateCondBr(IRB.CreateICmpEQ(LI, ConstantInt::get(Int32Ty, 0)),
+                       Decrypt, Rest);
+      IRB.SetInsertPoint(Decrypt);
+      HandleStringDecryption(IRB, Rest, DecryptSpace, KeyConst, EncryptedGV);
+      StoreInst *SI = IRB.CreateStore(ConstantInt::get(Int32Ty, 1), StatusGV);
+      SI->setAlignment(Align(4));
+      SI->setAtomic(AtomicOrdering::Release);
+      IRB.CreateBr(Rest);
+    }
+  }
+
+  // Whether the memory Ptr points to is only ever read through it
+  static bool isOnlyRead(Value *Ptr) {
+    SmallVector<Value *, 8> Worklist{Ptr};
+    SmallPtrSet<Value *, 8> Visited;
+    while (!Worklist.empty()) {
+      Value *V = Worklist.pop_back_val();
+      if (!Visited.insert(V).second)
+        continue;
+      for (Use &U : V->uses()) {
+        User *I = U.getUser();
+        if (isa<LoadInst>(I) || isa<ICmpInst>(I))
+          continue;
+        if (isa<GetElementPtrInst>(I) || isa<BitCastInst>(I) ||
+            isa<PHINode>(I) || isa<SelectInst>(I)) {
+          Worklist.emplace_back(I);
           continue;
-        Value *offset =
-            ConstantInt::get(Type::getInt64Ty(B->getContext()), realkeyoff);
-        Value *offset2 = ConstantInt::get(Type::getInt64Ty(B->getContext()), i);
-        Value *EncryptedGEP =
-            IRB.CreateGEP(iter->second.second->getValueType(),
-                          iter->second.second, {zero, offset});
-        Value *DecryptedGEP =
-            rust_string
-                ? IRB.CreateGEP(
-                      CA->getOperand(0)->getType(),
-                      IRB.CreateGEP(
-                          CA->getType(), iter->first,
-                          {zero, ConstantInt::getNullValue(
-                                     Type::getInt64Ty(B->getContext()))}),
-                      {zero, offset2})
-                : IRB.CreateGEP(iter->first->getValueType(), iter->first,
-                                {zero, offset2});
-        LoadInst *LI = IRB.CreateLoad(CastedCDA->getElementType(), EncryptedGEP,
-                                      "EncryptedChar");
-        Value *XORed = IRB.CreateXor(LI, CastedCDA->getElementAsConstant(i));
-        IRB.CreateStore(XORed, DecryptedGEP);
-        realkeyoff++;
+        }
+        if (CallBase *CB = dyn_cast<CallBase>(I))
+          if (CB->isArgOperand(&U) &&
+              CB->onlyReadsMemory(CB->getArgOperandNo(&U)))
+            continue;
+        return false;
       }
     }
-    IRB.CreateBr(C);
-  } // End of HandleDecryptionBlock
+    return true;
+  }
+
+  // Moves Func's uses of a short, fully encrypted string to a stack buffer
+  // that is decrypted with one vector XOR on every call, so the shared decrypt
+  // space is never written on its behalf. Only read-only literals qualify, as
+  // a per-call copy would lose the program's own writes. Gives up if the
+  // pointer may escape or be written through, or the decrypt space is
+  // referenced from another global, e.g. a CFString.
+  bool HandleStackString(Function *Func, GlobalVariable *DecryptSpace,
+                         Constant *KeyConst, GlobalVariable *EncryptedGV) {
+    const DataLayout &DL = Func->getParent()->getDataLayout();
+    Type *DecryptTy = DecryptSpace->getValueType();
+    ConstantDataArray *Keys = dyn_cast<ConstantDataArray>(KeyConst);
+    if (!Keys || !readonlystrings.count(DecryptSpace) ||
+        !encryptedmask[DecryptSpace].all() ||
+        DL.getTypeAllocSize(DecryptTy) > StackLimitTemp ||
+        DecryptSpace->getAddressSpace() != DL.getAllocaAddrSpace())
+      return false;
+    SmallVector<Use *, 8> Uses;
+    for (Use &U : DecryptSpace->uses()) {
+      Instruction *I = dyn_cast<Instruction>(U.getUser());
+      if (!I)
+        return false;
+      if (I->getFunction() == Func)
+        Uses.emplace_back(&U);
+    }
+    if (Uses.empty())
+      return false;
+    AllocaInst *AI = new AllocaInst(
+        DecryptTy, DL.getAllocaAddrSpace(), nullptr,
+        DL.getPrefTypeAlign(DecryptTy), "StackString",
+        &*Func->getEntryBlock().getFirstInsertionPt());
+    for (Use *U : Uses)
+      U->set(AI);
+    if (PointerMayBeCaptured(AI, true, true) || !isOnlyRead(AI)) {
+      for (Use *U : Uses)
+        U->set(DecryptSpace);
+      AI->eraseFromParent();
+      return false;
+    }
+    IRBuilder<> IRB(AI->getNextNode());
+    Type *ElementTy = Keys->getElementType();
+    Align ElementAlign = DL.getABITypeAlign(ElementTy);
+    SmallVector<Constant *, 32> KeyElements;
+    for (unsigned i = 0; i < Keys->getNumElements(); i++)
+      KeyElements.emplace_back(Keys->getElementAsConstant(i));
+    // Volatile for the same reason as in HandleDecryptionBlock
+    LoadInst *LI = IRB.CreateAlignedLoad(
+        FixedVectorType::get(ElementTy, Keys->getNumElements()), EncryptedGV,
+        ElementAlign, true, "EncryptedString");
+    Value *Zero = ConstantInt::get(Type::getInt32Ty(Func->getContext()), 0);
+    Value *Dest = isa<ArrayType>(DecryptTy) &&
+                          DecryptTy->getArrayElementType()->isIntegerTy()
+                      ? AI
+                      : IRB.CreateGEP(DecryptTy, AI, {Zero, Zero});
+    IRB.CreateAlignedStore(
+        IRB.CreateXor(LI, ConstantVector::get(KeyElements)), Dest,
+        ElementAlign);
+    return true;
+  }
+
+  // Emits a loop that regenerates the keystream from Seed and decrypts
+  // EncryptedGV into DecryptedArray, leaving IRB at the loop exit
+  void HandleKeystreamDecryption(IRBuilder<> &IRB, BasicBlock *C,
+                                 ConstantInt *Seed, GlobalVariable *EncryptedGV,
+                                 Value *DecryptedArray) {
+    LLVMContext &Ctx = C->getContext();
+    Function *F = C->getParent();
+    ArrayType *AT = cast<ArrayType>(EncryptedGV->getValueType());
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    Value *Zero = ConstantInt::get(Int64Ty, 0);
+    BasicBlock *Preheader = IRB.GetInsertBlock();
+    BasicBlock *Loop = BasicBlock::Create(Ctx, "KeystreamDecryption", F, C);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "KeystreamDecryptionEnd", F, C);
+    IRB.CreateBr(Loop);
+
+    IRB.SetInsertPoint(Loop);
+    PHINode *Index = IRB.CreatePHI(Int64Ty, 2);
+    PHINode *State = IRB.CreatePHI(Int64Ty, 2);
+    Index->addIncoming(Zero, Preheader);
+    State->addIncoming(Seed, Preheader);
+    Value *Next = CreateKeystreamStep(IRB, State);
+    // Volatile for the same reason as in HandleDecryptionBlock: a fully
+    // unrolled loop over constant ciphertext would fold to the plaintext
+    LoadInst *LI =
+        IRB.CreateLoad(AT->getElementType(),
+                       IRB.CreateGEP(AT, EncryptedGV, {Zero, Index}), true,
+                       "EncryptedChar");
+    IRB.CreateStore(
+        IRB.CreateXor(LI, IRB.CreateTrunc(Next, AT->getElementType())),
+        IRB.CreateGEP(AT, DecryptedArray, {Zero, Index}));
+    Value *NextIndex = IRB.CreateAdd(Index, ConstantInt::get(Int64Ty, 1));
+    Index->addIncoming(NextIndex, Loop);
+    State->addIncoming(Next, Loop);
+    IRB.CreateCondBr(
+        IRB.CreateICmpULT(NextIndex,
+                          ConstantInt::get(Int64Ty, AT->getNumElements())),
+        Loop, Exit);
+    IRB.SetInsertPoint(Exit);
+  }
+
+  // Returns `void DecompressString(ptr Src, i64 SrcLen, ptr Dst, i64 Seed)`,
+  // the inverse of compressString followed by encryptCompressed. It is shared
+  // by every compressed string in the module.
+  Function *GetStringDecompressor(Module &M) {
+    if (decompressor)
+      return decompressor;
+    LLVMContext &Ctx = M.getContext();
+    Type *Int8Ty = Type::getInt8Ty(Ctx);
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    Type *PtrTy = PointerType::getUnqual(Ctx);
+    Function *F = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx),
+                          {PtrTy, Int64Ty, PtrTy, Int64Ty}, false),
+        GlobalValue::PrivateLinkage, "DecompressString", M);
+    F->addFnAttr(Attribute::NoInline);
+    F->addFnAttr(Attribute::NoUnwind);
+    // Ciphertext and decrypt space are always distinct globals
+    for (unsigned ArgNo : {0, 2}) {
+      F->addParamAttr(ArgNo, Attribute::NoAlias);
+      F->addParamAttr(ArgNo, Attribute::NoCapture);
+    }
+    F->addParamAttr(0, Attribute::ReadOnly);
+    genedfuncs.insert(F);
+    decompressor = F;
+    Value *Src = F->getArg(0), *SrcLen = F->getArg(1), *Dst = F->getArg(2),
+          *Seed = F->getArg(3);
+    Value *Zero = ConstantInt::get(Int64Ty, 0);
+    Value *One = ConstantInt::get(Int64Ty, 1);
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "", F);
+    BasicBlock *Head = BasicBlock::Create(Ctx, "Sequence", F);
+    BasicBlock *Token = BasicBlock::Create(Ctx, "LiteralCount", F);
+    BasicBlock *Literal = BasicBlock::Create(Ctx, "Literal", F);
+    BasicBlock *LiteralBody = BasicBlock::Create(Ctx, "CopyLiteral", F);
+    BasicBlock *MatchLen = BasicBlock::Create(Ctx, "MatchLength", F);
+    BasicBlock *Distance = BasicBlock::Create(Ctx, "MatchDistance", F);
+    BasicBlock *Copy = BasicBlock::Create(Ctx, "CopyDisjointMatch", F);
+    BasicBlock *Match = BasicBlock::Create(Ctx, "Match", F);
+    BasicBlock *MatchBody = BasicBlock::Create(Ctx, "CopyMatch", F);
+    BasicBlock *MatchEnd = BasicBlock::Create(Ctx, "MatchEnd", F);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "", F);
+    IRBuilder<> IRB(Entry);
+    // Decrypts the next compressed byte, returning it zero-extended along
+    // with the advanced position and keystream state
+    auto ReadByte = [&](Value *Pos, Value *State) {
+      Value *Next = CreateKeystreamStep(IRB, State);
+      // Not volatile unlike HandleDecryptionBlock: the control flow depends on
+      // every decrypted byte, so the loop cannot fold into the plaintext.
+      // Callers publish Dst through their status flag once this returns.
+      LoadInst *LI = IRB.CreateLoad(Int8Ty, IRB.CreateGEP(Int8Ty, Src, Pos),
+                                    "EncryptedChar");
+      Value *Byte =
+          IRB.CreateZExt(IRB.CreateXor(LI, IRB.CreateTrunc(Next, Int8Ty)),
+                         Int64Ty);
+      return std::make_tuple(Byte, IRB.CreateAdd(Pos, One), Next);
+    };
+    IRB.CreateBr(Head);
+
+    IRB.SetInsertPoint(Head);
+    PHINode *Pos = IRB.CreatePHI(Int64Ty, 3);
+    PHINode *Out = IRB.CreatePHI(Int64Ty, 3);
+    PHINode *State = IRB.CreatePHI(Int64Ty, 3);
+    Pos->addIncoming(Zero, Entry);
+    Out->addIncoming(Zero, Entry);
+    State->addIncoming(Seed, Entry);
+    IRB.CreateCondBr(IRB.CreateICmpULT(Pos, SrcLen), Token, Exit);
+
+    IRB.SetInsertPoint(Token);
+    auto [LiteralCount, TokenPos, TokenState] = ReadByte(Pos, State);
+    IRB.CreateBr(Literal);
+
+    IRB.SetInsertPoint(Literal);
+    PHINode *I = IRB.CreatePHI(Int64Ty, 2);
+    PHINode *LiteralPos = IRB.CreatePHI(Int64Ty, 2);
+    PHINode *LiteralState = IRB.CreatePHI(Int64Ty, 2);
+    I->addIncoming(Zero, Token);
+    LiteralPos->addIncoming(TokenPos, Token);
+    LiteralState->addIncoming(TokenState, Token);
+    IRB.CreateCondBr(IRB.CreateICmpULT(I, LiteralCount), LiteralBody,
+                     MatchLen);
+
+    IRB.SetInsertPoint(LiteralBody);
+    auto [Byte, NextPos, NextState] = ReadByte(LiteralPos, LiteralState);
+    IRB.CreateStore(IRB.CreateTrunc(Byte, Int8Ty),
+                    IRB.CreateGEP(Int8Ty, Dst, IRB.CreateAdd(Out, I)));
+    I->addIncoming(IRB.CreateAdd(I, One), LiteralBody);
+    LiteralPos->addIncoming(NextPos, LiteralBody);
+    LiteralState->addIncoming(NextState, LiteralBody);
+    IRB.CreateBr(Literal);
+
+    IRB.SetInsertPoint(MatchLen);
+    Value *MatchOut = IRB.CreateAdd(Out, LiteralCount);
+    auto [Length, LengthPos, LengthState] =
+        ReadByte(LiteralPos, LiteralState);
+    Pos->addIncoming(LengthPos, MatchLen);
+    Out->addIncoming(MatchOut, MatchLen);
+    State->addIncoming(LengthState, MatchLen);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Length, Zero), Head, Distance);
+
+    IRB.SetInsertPoint(Distance);
+    auto [Low, LowPos, LowState] = ReadByte(LengthPos, LengthState);
+    auto [High, HighPos, HighState] = ReadByte(LowPos, LowState);
+    Value *MatchDistance = IRB.CreateOr(Low, IRB.CreateShl(High, 8));
+    Value *From = IRB.CreateSub(MatchOut, MatchDistance);
+    IRB.CreateCondBr(IRB.CreateICmpUGE(MatchDistance, Length), Copy, Match);
+
+    // A match at least as far back as it is long reads none of the bytes it
+    // produces, so it is a plain memcpy rather than a serial byte loop
+    IRB.SetInsertPoint(Copy);
+    IRB.CreateMemCpy(IRB.CreateGEP(Int8Ty, Dst, MatchOut), Align(1),
+                     IRB.CreateGEP(Int8Ty, Dst, From), Align(1), Length);
+    IRB.CreateBr(MatchEnd);
+
+    // Byte by byte, as an overlapping match reads the bytes it produces
+    IRB.SetInsertPoint(Match);
+    PHINode *J = IRB.CreatePHI(Int64Ty, 2);
+    J->addIncoming(Zero, Distance);
+    IRB.CreateCondBr(IRB.CreateICmpULT(J, Length), MatchBody, MatchEnd);
+
+    IRB.SetInsertPoint(MatchBody);
+    IRB.CreateStore(
+        IRB.CreateLoad(Int8Ty,
+                       IRB.CreateGEP(Int8Ty, Dst, IRB.CreateAdd(From, J))),
+        IRB.CreateGEP(Int8Ty, Dst, IRB.CreateAdd(MatchOut, J)));
+    J->addIncoming(IRB.CreateAdd(J, One), MatchBody);
+    IRB.CreateBr(Match);
+
+    IRB.SetInsertPoint(MatchEnd);
+    Pos->addIncoming(HighPos, MatchEnd);
+    Out->addIncoming(IRB.CreateAdd(MatchOut, Length), MatchEnd);
+    State->addIncoming(HighState, MatchEnd);
+    IRB.CreateBr(Head);
+
+    IRB.SetInsertPoint(Exit);
+    IRB.CreateRetVoid();
+    return F;
+  }
+
+  // Builds `void DecryptTableChunks(i64 First, i64 Last)`, which decrypts
+  // every chunk of DecryptSpace in [First, Last] whose guard is still clear.
+  // Like the per-function status, a guard is only set once its chunk is
+  // written, so racing threads at worst decrypt the same chunk twice.
+  Function *BuildChunkDecryptor(GlobalVariable *EncryptedGV,
+                                GlobalVariable *DecryptSpace,
+                                ConstantInt *Seed) {
+    Module *M = DecryptSpace->getParent();
+    LLVMContext &Ctx = M->getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    ArrayType *AT = cast<ArrayType>(EncryptedGV->getValueType());
+    Type *ElementTy = AT->getElementType();
+    const uint64_t PerChunk =
+        TableChunkSize / (ElementTy->getIntegerBitWidth() / 8);
+    const uint64_t NumChunks = divideCeil(AT->getNumElements(), PerChunk);
+    ArrayType *GuardsTy = ArrayType::get(Int32Ty, NumChunks);
+    GlobalVariable *Guards = new GlobalVariable(
+        *M, GuardsTy, false, GlobalValue::PrivateLinkage,
+        Constant::getNullValue(GuardsTy), "TableChunkStatus");
+    Guards->setAlignment(Align(4));
+    genedgv.insert(Guards);
+    chunkguards[DecryptSpace] = Guards;
+    // Keeps the common guard test in HandleChunkedTable to a single chunk
+    DecryptSpace->setAlignment(Align(16));
+    appendToCompilerUsed(*M, {EncryptedGV});
+
+    Function *F = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), {Int64Ty, Int64Ty}, false),
+        GlobalValue::PrivateLinkage, "DecryptTableChunks", M);
+    F->addFnAttr(Attribute::NoInline);
+    F->addFnAttr(Attribute::NoUnwind);
+    genedfuncs.insert(F);
+    Value *First = F->getArg(0), *Last = F->getArg(1);
+    Value *Zero = ConstantInt::get(Int64Ty, 0);
+    Value *One = ConstantInt::get(Int64Ty, 1);
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "", F);
+    BasicBlock *ChunkLoop = BasicBlock::Create(Ctx, "TableChunk", F);
+    BasicBlock *Decrypt = BasicBlock::Create(Ctx, "TableChunkDecryption", F);
+    BasicBlock *Loop = BasicBlock::Create(Ctx, "KeystreamDecryption", F);
+    BasicBlock *Decrypted = BasicBlock::Create(Ctx, "TableChunkDecrypted", F);
+    BasicBlock *Latch = BasicBlock::Create(Ctx, "NextTableChunk", F);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "", F);
+    IRBuilder<> IRB(Entry);
+    IRB.CreateBr(ChunkLoop);
+
+    IRB.SetInsertPoint(ChunkLoop);
+    PHINode *Chunk = IRB.CreatePHI(Int64Ty, 2);
+    Chunk->addIncoming(First, Entry);
+    Value *GuardPtr = IRB.CreateGEP(GuardsTy, Guards, {Zero, Chunk});
+    LoadInst *Guard =
+        IRB.CreateAlignedLoad(Int32Ty, GuardPtr, Align(4), "LoadChunkStatus");
+    Guard->setAtomic(AtomicOrdering::Acquire);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Guard, ConstantInt::get(Int32Ty, 0)),
+                     Decrypt, Latch);
+
+    IRB.SetInsertPoint(Decrypt);
+    Value *Begin = IRB.CreateMul(Chunk, ConstantInt::get(Int64Ty, PerChunk));
+    Value *End = IRB.CreateAdd(Begin, ConstantInt::get(Int64Ty, PerChunk));
+    Value *Size = ConstantInt::get(Int64Ty, AT->getNumElements());
+    End = IRB.CreateSelect(IRB.CreateICmpULT(End, Size), End, Size);
+    // chunkSeed
+    Value *ChunkSeed = IRB.CreateMul(
+        IRB.CreateAdd(Chunk, One),
+        ConstantInt::get(Int64Ty, 0x9E3779B97F4A7C15ULL));
+    ChunkSeed = IRB.CreateOr(IRB.CreateXor(Seed, ChunkSeed), One);
+    IRB.CreateBr(Loop);
+
+    IRB.SetInsertPoint(Loop);
+    PHINode *Index = IRB.CreatePHI(Int64Ty, 2);
+    PHINode *State = IRB.CreatePHI(Int64Ty, 2);
+    Index->addIncoming(Begin, Decrypt);
+    State->addIncoming(ChunkSeed, Decrypt);
+    Value *Next = CreateKeystreamStep(IRB, State);
+    // Volatile for the same reason as in HandleDecryptionBlock
+    LoadInst *LI = IRB.CreateLoad(
+        ElementTy, IRB.CreateGEP(AT, EncryptedGV, {Zero, Index}), true,
+        "EncryptedChar");
+    IRB.CreateStore(IRB.CreateXor(LI, IRB.CreateTrunc(Next, ElementTy)),
+                    IRB.CreateGEP(AT, DecryptSpace, {Zero, Index}));
+    Value *NextIndex = IRB.CreateAdd(Index, One);
+    Index->addIncoming(NextIndex, Loop);
+    State->addIncoming(Next, Loop);
+    IRB.CreateCondBr(IRB.CreateICmpULT(NextIndex, End), Loop, Decrypted);
+
+    IRB.SetInsertPoint(Decrypted);
+    StoreInst *SI = IRB.CreateAlignedStore(ConstantInt::get(Int32Ty, 1),
+                                           GuardPtr, Align(4));
+    SI->setAtomic(AtomicOrdering::Release);
+    IRB.CreateBr(Latch);
+
+    IRB.SetInsertPoint(Latch);
+    Value *NextChunk = IRB.CreateAdd(Chunk, One);
+    Chunk->addIncoming(NextChunk, Latch);
+    IRB.CreateCondBr(IRB.CreateICmpULE(NextChunk, Last), ChunkLoop, Exit);
+
+    IRB.SetInsertPoint(Exit);
+    IRB.CreateRetVoid();
+    return F;
+  }
+
+  // Puts a check of the touched chunk in front of every load and store Func
+  // makes through DecryptSpace. If the table's address is used in any other
+  // way, the whole table is decrypted on entry instead, as it would be
+  // without chunking.
+  void HandleChunkedTable(Function *Func, GlobalVariable *DecryptSpace,
+                          Function *Decryptor) {
+    const DataLayout &DL = Func->getParent()->getDataLayout();
+    LLVMContext &Ctx = Func->getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    GlobalVariable *Guards = chunkguards[DecryptSpace];
+    uint64_t NumChunks =
+        cast<ArrayType>(Guards->getValueType())->getNumElements();
+    SmallVector<Use *, 16> Worklist;
+    SmallVector<Instruction *, 16> Accesses;
+    bool Escapes = false;
+    for (Use &U : DecryptSpace->uses()) {
+      if (Instruction *I = dyn_cast<Instruction>(U.getUser())) {
+        if (I->getFunction() == Func)
+          Worklist.emplace_back(&U);
+      } else if (any_of(U.getUser()->users(), [Func](User *U2) {
+                   Instruction *I = dyn_cast<Instruction>(U2);
+                   return I && I->getFunction() == Func;
+                 })) {
+        Escapes = true;
+      }
+    }
+    while (!Worklist.empty() && !Escapes) {
+      Use *U = Worklist.pop_back_val();
+      Instruction *I = cast<Instruction>(U->getUser());
+      if (isa<GetElementPtrInst>(I) && U->getOperandNo() == 0) {
+        for (Use &U2 : I->uses())
+          Worklist.emplace_back(&U2);
+      } else if ((isa<LoadInst>(I) &&
+                  U->getOperandNo() == LoadInst::getPointerOperandIndex()) ||
+                 (isa<StoreInst>(I) &&
+                  U->getOperandNo() == StoreInst::getPointerOperandIndex())) {
+        Accesses.emplace_back(I);
+      } else {
+        Escapes = true;
+      }
+    }
+    if (Escapes) {
+      IRBuilder<> IRB(&*Func->getEntryBlock().getFirstInsertionPt());
+      IRB.CreateCall(Decryptor, {ConstantInt::get(Int64Ty, 0),
+                                 ConstantInt::get(Int64Ty, NumChunks - 1)});
+      return;
+    }
+    const unsigned ChunkShift = Log2_64(TableChunkSize);
+    for (Instruction *I : Accesses) {
+      uint64_t Size = DL.getTypeStoreSize(getLoadStoreType(I));
+      Align CommonAlign = std::min(getLoadStoreAlignment(I),
+                                   DecryptSpace->getAlign().valueOrOne());
+      IRBuilder<> IRB(I);
+      Value *Offset =
+          IRB.CreateSub(IRB.CreatePtrToInt(getLoadStorePointerOperand(I),
+                                           Int64Ty),
+                        IRB.CreatePtrToInt(DecryptSpace, Int64Ty));
+      Value *First = IRB.CreateLShr(Offset, ChunkShift);
+      if (!isPowerOf2_64(Size) || Size > CommonAlign.value()) {
+        // May straddle two chunks, let the decryptor test both
+        Value *Last = IRB.CreateLShr(
+            IRB.CreateAdd(Offset, ConstantInt::get(Int64Ty, Size - 1)),
+            ChunkShift);
+        IRB.CreateCall(Decryptor, {First, Last});
+        continue;
+      }
+      // A naturally aligned access lies in a single chunk, so the fast path
+      // is one acquire load
+      LoadInst *Guard = IRB.CreateAlignedLoad(
+          Int32Ty,
+          IRB.CreateGEP(Guards->getValueType(), Guards,
+                        {ConstantInt::get(Int64Ty, 0), First}),
+          Align(4), "LoadChunkStatus");
+      Guard->setAtomic(AtomicOrdering::Acquire);
+      Instruction *ThenTerm = SplitBlockAndInsertIfThen(
+          IRB.CreateICmpEQ(Guard, ConstantInt::get(Int32Ty, 0)), I, false,
+          MDBuilder(Ctx).createBranchWeights(1, 1000));
+      IRB.SetInsertPoint(ThenTerm);
+      IRB.CreateCall(Decryptor, {First, First});
+    }
+  }
 };
 
 ModulePass *createStringEncryptionPass(bool flag) {
@@ -17,14 +17,16 @@ using namespace llvm;
 static cl::opt<uint32_t>
     ObfTimes("sub_loop",
              cl::desc("Choose how many time the -sub pass loops on a function"),
-             cl::value_desc("number of times"), cl::init(1), cl::Optional);
+             cl::value_desc("number of times"), cl::init(1), cl::Optional,
+             CacheKeyOption());
 static uint32_t ObfTimesTemp = 1;
 
 static cl::opt<uint32_t>
     ObfProbRate("sub_prob",
                 cl::desc("Choose the probability [%] each instructions will be "
                          "obfuscated by the InstructionSubstitution pass"),
-                cl::value_desc("probability rate"), cl::init(50), cl::Optional);
+                cl::value_desc("probability rate"), cl::init(50), cl::Optional,
+                CacheKeyOption());
 static uint32_t ObfProbRateTemp = 50;
 
 // Stats
@@ -66,7 +68,8 @@ struct Substitution : public FunctionPass {
     Function *tmp = &F;
     // Do we obfuscate
     if (toObfuscate(flag, tmp, "sub")) {
-      errs() << "Running Instruction Substitution On " << F.getName() << "\n";
+      hikariLog(2) << "Running Instruction Substitution On " << F.getName()
+                   << "\n";
       substitute(tmp);
       return true;
     }
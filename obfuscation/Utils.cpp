@@ -2,21 +2,110 @@
 // [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
 //===----------------------------------------------------------------------===//
 #include "include/Utils.h"
+#include "include/CryptoUtils.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/NoFolder.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include <mutex>
+#include <optional>
 #include <set>
 #include <sstream>
 
 using namespace llvm;
 
+static cl::opt<uint32_t> Verbosity(
+    "hikari_verbose",
+    cl::desc("Console logging level of Hikari: 0 only reports errors, 1 adds "
+             "per-module progress, 2 adds per-function progress"),
+    cl::value_desc("level"), cl::init(1), cl::Optional);
+
+enum class ODRMode { Obfuscate, Defer };
+static cl::opt<ODRMode> ODRObfuscation(
+    "hikari_odr",
+    cl::desc("How to treat linkonce_odr/weak_odr functions, which every "
+             "translation unit using them emits and the linker deduplicates"),
+    cl::values(clEnumValN(ODRMode::Obfuscate, "obfuscate",
+                          "Obfuscate every copy independently"),
+               clEnumValN(ODRMode::Defer, "defer",
+                          "Skip them. Full LTO internalizes the copy it "
+                          "keeps, so -hikari_ep=full-lto-last still "
+                          "obfuscates it once. ThinLTO keeps it weak_odr and "
+                          "builds without LTO never see it again, so there "
+                          "they stay unobfuscated")),
+    cl::init(ODRMode::Obfuscate), CacheKeyOption());
+
+static cl::opt<bool> FunctionSeeds(
+    "hikari_function_seeds",
+    cl::desc("Give every function its own PRNG stream, derived from the seed "
+             "and the function's name, so that how a function is obfuscated "
+             "does not depend on the other functions in the module"),
+    cl::init(false), CacheKeyOption());
+static std::optional<uint64_t> FunctionSeedBase;
+
 namespace llvm {
 
+raw_ostream &hikariLog(uint32_t level) {
+  return level <= Verbosity ? errs() : nulls();
+}
+
+bool deferODRFunctions() { return ODRObfuscation == ODRMode::Defer; }
+
+void initFunctionSeeds(std::optional<uint64_t> Seed) {
+  FunctionSeedBase.reset();
+  if (FunctionSeeds)
+    FunctionSeedBase = Seed ? *Seed : cryptoutils->get_uint64_t();
+}
+
+FunctionSeedScope::FunctionSeedScope(Function &F)
+    : Active(FunctionSeedBase.has_value()) {
+  if (Active)
+    cryptoutils->push_seed(*FunctionSeedBase ^ xxh3_64bits(F.getName()));
+}
+
+FunctionSeedScope::~FunctionSeedScope() {
+  if (Active)
+    cryptoutils->pop_seed();
+}
+
+// Function-local so that options in other translation units can register
+// themselves during static initialization
+using CacheKeyEntry =
+    std::pair<const cl::Option *, std::function<std::string()>>;
+static std::vector<CacheKeyEntry> &cacheKeyOptionRegistry() {
+  static std::vector<CacheKeyEntry> Registry;
+  return Registry;
+}
+
+void registerCacheKeyOption(const cl::Option &O,
+                            std::function<std::string()> Value) {
+  cacheKeyOptionRegistry().emplace_back(&O, std::move(Value));
+}
+
+std::string cacheKeyOptions() {
+  std::vector<std::pair<StringRef, std::string>> Values;
+  for (CacheKeyEntry &Entry : cacheKeyOptionRegistry())
+    Values.emplace_back(Entry.first->ArgStr, Entry.second());
+  llvm::sort(Values);
+  std::string Key;
+  for (auto &Value : Values)
+    Key += (Value.first + "=" + Value.second + ";").str();
+  return Key;
+}
+
 // Shamefully borrowed from ../Scalar/RegToMem.cpp :(
 bool valueEscapes(Instruction *Inst) {
   BasicBlock *BB = Inst->getParent();
@@ -31,6 +120,7 @@ bool valueEscapes(Instruction *Inst) {
 }
 
 void fixStack(Function *f) {
+  TimeTraceScope TimeScope("fixStack", f->getName());
   // Try to remove phi node and demote reg to stack
   SmallVector<PHINode *, 8> tmpPhi;
   SmallVector<Instruction *, 32> tmpReg;
@@ -126,6 +216,9 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
   if (f->isDeclaration() || f->hasAvailableExternallyLinkage()) {
     return false;
   }
+  if (ODRObfuscation == ODRMode::Defer &&
+      (f->hasLinkOnceODRLinkage() || f->hasWeakODRLinkage()))
+    return false;
   std::string attr = attribute;
   std::string attrNo = "no" + attr;
   if (readAnnotationMetadata(f, attrNo) || readFlag(f, attrNo)) {
@@ -267,16 +360,6 @@ void FixFunctionConstantExpr(Function *Func) {
     FixBasicBlockConstantExpr(&BB);
 }
 
-void turnOffOptimization(Function *f) {
-  f->removeFnAttr(Attribute::AttrKind::MinSize);
-  f->removeFnAttr(Attribute::AttrKind::OptimizeForSize);
-  if (!f->hasFnAttribute(Attribute::AttrKind::OptimizeNone) &&
-      !f->hasFnAttribute(Attribute::AttrKind::AlwaysInline)) {
-    f->addFnAttr(Attribute::AttrKind::OptimizeNone);
-    f->addFnAttr(Attribute::AttrKind::NoInline);
-  }
-}
-
 static inline std::vector<std::string> splitString(std::string str) {
   std::stringstream ss(str);
   std::string word;
@@ -366,6 +449,76 @@ bool AreUsersInOneFunction(GlobalVariable *GV) {
   return userFunctions.size() <= 1;
 }
 
+namespace {
+struct PrecompiledIR {
+  sys::TimePoint<> ModTime;
+  // Shared with every lazily loaded module still reading from it, so a
+  // buffer replaced after an mtime change is freed with its last module
+  std::shared_ptr<MemoryBuffer> Buffer;
+};
+struct PrecompiledIRCache {
+  std::mutex Lock;
+  StringMap<PrecompiledIR> Entries;
+};
+// Lets a lazily loaded module own a reference to a cached buffer
+class SharedMemoryBuffer : public MemoryBuffer {
+public:
+  SharedMemoryBuffer(std::shared_ptr<MemoryBuffer> Owner)
+      : Owner(std::move(Owner)) {
+    init(this->Owner->getBufferStart(), this->Owner->getBufferEnd(), false);
+  }
+  StringRef getBufferIdentifier() const override {
+    return Owner->getBufferIdentifier();
+  }
+  BufferKind getBufferKind() const override { return Owner->getBufferKind(); }
+
+private:
+  std::shared_ptr<MemoryBuffer> Owner;
+};
+} // namespace
+static ManagedStatic<PrecompiledIRCache> precompiledIRCache;
+
+// Reads the pre-compiled handler IR at most once per process (and again only
+// when its mtime changes) and hands out a lazily materialized module for the
+// given context, so linking it only deserializes the functions actually used
+std::unique_ptr<Module> loadPrecompiledModule(StringRef Path,
+                                              LLVMContext &Context) {
+  sys::fs::file_status Status;
+  if (Path.empty() || sys::fs::status(Path, Status) ||
+      !sys::fs::is_regular_file(Status))
+    return nullptr;
+  std::shared_ptr<MemoryBuffer> Buffer;
+  {
+    std::lock_guard<std::mutex> Guard(precompiledIRCache->Lock);
+    PrecompiledIR &Entry = precompiledIRCache->Entries[Path];
+    if (!Entry.Buffer ||
+        Entry.ModTime != Status.getLastModificationTime()) {
+      ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+          MemoryBuffer::getFile(Path);
+      if (!BufferOrErr)
+        return nullptr;
+      Entry.Buffer = std::move(*BufferOrErr);
+      Entry.ModTime = Status.getLastModificationTime();
+    }
+    Buffer = Entry.Buffer;
+  }
+  MemoryBufferRef BufferRef = Buffer->getMemBufferRef();
+  if (isBitcode(
+          reinterpret_cast<const unsigned char *>(BufferRef.getBufferStart()),
+          reinterpret_cast<const unsigned char *>(BufferRef.getBufferEnd()))) {
+    Expected<std::unique_ptr<Module>> ModuleOrErr = getOwningLazyBitcodeModule(
+        std::make_unique<SharedMemoryBuffer>(std::move(Buffer)), Context);
+    if (!ModuleOrErr) {
+      errs() << "Failed To Parse PreCompiled IR From:" << Path << ": "
+             << toString(ModuleOrErr.takeError()) << "\n";
+      return nullptr;
+    }
+    return std::move(*ModuleOrErr);
+  }
+  SMDiagnostic SMD;
+  return parseIR(BufferRef, SMD, Context);
+}
+
 #if 0
 std::map<GlobalValue *, StringRef> BuildAnnotateMap(Module &M) {
   std::map<GlobalValue *, StringRef> VAMap;
@@ -17,22 +17,34 @@
 #ifndef _CRYPTO_UTILS_H_
 #define _CRYPTO_UTILS_H_
 
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/ManagedStatic.h"
 #include <cstdio>
 #include <map>
 #include <random>
 #include <stdint.h>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 namespace llvm {
 
+class IntegerType;
+
 class CryptoUtils {
 public:
   CryptoUtils();
   ~CryptoUtils();
   void prng_seed(std::uint_fast64_t seed);
   void prng_seed();
+  // Temporarily switch to an independent stream, e.g. to obfuscate one
+  // function reproducibly, then resume the previous one where it left off
+  void push_seed(std::uint_fast64_t seed);
+  void pop_seed();
   template <typename T> T get() {
     std::uint_fast64_t num = get_raw();
     return static_cast<T>(num);
@@ -44,18 +56,39 @@ public:
   uint64_t get_uint64_t() { return get<uint64_t>(); };
   uint32_t get_uint8_t() { return get<uint8_t>(); };
   uint32_t get_uint16_t() { return get<uint16_t>(); };
+  // Fill Buf with random integers, slicing each 64-bit draw into as many
+  // elements as fit instead of drawing once per element
+  template <typename T> void fill(MutableArrayRef<T> Buf) {
+    static_assert(std::is_integral<T>::value && sizeof(T) <= 8,
+                  "fill() takes integers of at most 64 bits");
+    constexpr unsigned PerDraw = sizeof(uint64_t) / sizeof(T);
+    for (size_t i = 0; i < Buf.size(); i += PerDraw) {
+      uint64_t W = get_raw();
+      for (unsigned j = 0; j < PerDraw && i + j < Buf.size(); j++)
+        Buf[i + j] = static_cast<T>(W >> (j * sizeof(T) * 8));
+    }
+  }
+  // Return N random keys of integer type Ty, drawn through fill() on the
+  // narrowest element type that holds Ty
+  SmallVector<APInt, 16> fillKeys(IntegerType *Ty, unsigned N);
+  // Resize Mask to N bits, each set with probability Percent/100. Draws four
+  // 16-bit samples at a time and none at all for 0 or 100.
+  void get_bernoulli(BitVector &Mask, unsigned N, uint32_t Percent);
 
+  // Round keys of a 4-round Feistel network over the two 16-bit halves of a
+  // 32-bit value, drawn from the current stream
+  struct ScrambleKey {
+    uint32_t Rounds[4];
+  };
+  ScrambleKey get_scramble_key();
   // Scramble32 originally uses AES to generates the mapping relationship
-  // between a BB and its switchvar Hikari updates this by doing this using
-  // mt19937_64 in C++ STLs which is a faster but less cryprographically secured
-  // This method try to find the corresponding value from the VMap first, if not
-  // then use RNG to generate,fill and return the value
-  uint32_t
-  scramble32(uint32_t in,
-             std::unordered_map<uint32_t /*IDX*/, uint32_t /*VAL*/> &VMap);
+  // between a BB and its switchvar. It is now a keyed permutation, so distinct
+  // inputs always map to distinct values without keeping a table around
+  static uint32_t scramble32(uint32_t in, const ScrambleKey &Key);
 
 private:
   std::mt19937_64 *eng = nullptr;
+  std::vector<std::mt19937_64 *> saved;
   std::uint_fast64_t get_raw();
 };
 extern ManagedStatic<CryptoUtils> cryptoutils;
@@ -14,6 +14,7 @@
 #include "include/Split.h"
 #include "include/StringEncryption.h"
 #include "include/Substitution.h"
+#include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
@@ -23,12 +24,25 @@ namespace llvm {
 class ObfuscationPass : public PassInfoMixin<ObfuscationPass> {
 public:
   ObfuscationPass() {}
+  // FullLTOPostLink passes are added at the end of the full LTO link-time
+  // pipeline, the only place where -hikari_odr=defer gets to obfuscate the
+  // functions it skipped before
+  explicit ObfuscationPass(bool FullLTOPostLink)
+      : FullLTOPostLink(FullLTOPostLink) {}
+  // Skips modules that were already obfuscated, whether by a pass named in
+  // -passes or by one added from a pipeline extension point
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
   static bool isRequired() { return true; }
+
+private:
+  bool FullLTOPostLink = false;
 };
 
 ModulePass *createObfuscationLegacyPass();
 void initializeObfuscationPass(PassRegistry &Registry);
+#if LLVM_VERSION_MAJOR >= 18
+PassPluginLibraryInfo getHikariPluginInfo();
+#endif
 
 } // namespace llvm
 
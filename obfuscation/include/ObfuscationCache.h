@@ -0,0 +1,33 @@
+#ifndef _OBFUSCATION_CACHE_H_
+#define _OBFUSCATION_CACHE_H_
+
+#include "llvm/IR/Module.h"
+#include <string>
+
+namespace llvm {
+
+// On-disk cache of obfuscated modules, keyed by the SHA-256 of the module's
+// bitcode before obfuscation, every Hikari option that affects the output,
+// the PRNG seed and the plugin revision. Disabled unless -hikari_cache_dir is
+// given.
+class ObfuscationCache {
+public:
+  ObfuscationCache(Module &M, StringRef Config, uint64_t Seed,
+                   bool ExplicitSeed);
+  bool enabled() const { return !Key.empty(); }
+  // Seed to obfuscate this module with. Unless one was given explicitly it is
+  // derived from the key, so identical inputs produce identical outputs.
+  uint64_t seed() const { return Seed; }
+  // Replaces the contents of the module with the cached result, if any
+  bool load();
+  void store();
+
+private:
+  Module &M;
+  std::string Key;
+  uint64_t Seed;
+};
+
+} // namespace llvm
+
+#endif
@@ -2,7 +2,12 @@
 #define _UTILS_H_
 
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <functional>
+#include <optional>
 #include <string>
+#include <type_traits>
 
 namespace llvm {
 
@@ -12,11 +17,46 @@ bool toObfuscateBoolOption(Function *f, std::string option, bool *val);
 bool toObfuscateUint32Option(Function *f, std::string option, uint32_t *val);
 bool hasApplePtrauth(Module *M);
 void FixFunctionConstantExpr(Function *Func);
-void turnOffOptimization(Function *f);
 void annotation2Metadata(Module &M);
 bool readAnnotationMetadata(Function *f, std::string annotation);
 void writeAnnotationMetadata(Function *f, std::string annotation);
 bool AreUsersInOneFunction(GlobalVariable *GV);
+raw_ostream &hikariLog(uint32_t level);
+// -hikari_odr=defer, under which toObfuscate skips linkonce_odr/weak_odr
+bool deferODRFunctions();
+// Starts a module under -hikari_function_seeds. Every function's stream is
+// derived from Seed, or from a draw of the module stream if none was given.
+// Does nothing without the option.
+void initFunctionSeeds(std::optional<uint64_t> Seed);
+// While alive, draws from cryptoutils come from a stream derived from the
+// base and F's name instead of the module stream, under -hikari_function_seeds
+class FunctionSeedScope {
+public:
+  explicit FunctionSeedScope(Function &F);
+  ~FunctionSeedScope();
+
+private:
+  bool Active;
+};
+void registerCacheKeyOption(const cl::Option &O,
+                            std::function<std::string()> Value);
+// "name=value;" for every option tagged with CacheKeyOption, sorted by name
+std::string cacheKeyOptions();
+// cl::opt modifier for options that change the obfuscated output, so that
+// ObfuscationCache never returns bitcode produced under different settings
+struct CacheKeyOption {
+  template <class Opt> void apply(Opt &O) const {
+    registerCacheKeyOption(O, [&O]() -> std::string {
+      using T = std::decay_t<decltype(O.getValue())>;
+      if constexpr (std::is_same_v<T, std::string>)
+        return O.getValue();
+      else
+        return std::to_string(static_cast<uint64_t>(O.getValue()));
+    });
+  }
+};
+std::unique_ptr<Module> loadPrecompiledModule(StringRef Path,
+                                              LLVMContext &Context);
 #if 0
 std::map<GlobalValue*, StringRef> BuildAnnotateMap(Module& M);
 #endif
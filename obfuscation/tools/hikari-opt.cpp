@@ -0,0 +1,328 @@
+// For open-source license, please refer to
+// [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
+//===----------------------------------------------------------------------===//
+/*
+  hikari-opt: sharded out-of-process driver for the Hikari scheduler.
+  The input module is split with SplitModule, every partition is obfuscated
+  by a worker process with its own LLVMContext, and the results are linked
+  back together. Local symbols are kept together with their users.
+
+  Every worker runs with the same -aesSeed and -hikari_function_seeds, so
+  the random choices made for a function come from a stream derived from the
+  seed and its name alone. They depend neither on -j nor on -shards, and are
+  the ones a serial run given -hikari_function_seeds makes.
+
+  Deviations from a serial `opt -passes=hikari` run with the same seed:
+  - Without -hikari_function_seeds the serial run draws every function
+    from one module stream, so its output differs.
+  - Globals the passes create per module, such as IndirectBranch's jump
+    table, are created once per partition. Their layout, the order of the
+    linked module and the table indices baked into the code therefore still
+    vary with -shards.
+  - Module-level passes (StringEncryption, AntiDebugging, AntiHooking,
+    FunctionCallObfuscate, AntiClassDump) see one partition at a time, so
+    e.g. identical strings are only pooled within a partition and the
+    anti-debugging/anti-hooking setup is emitted once per partition. They
+    are refused unless -allow-module-passes is given.
+  - Peak memory is not reduced. The driver parses the whole module to split
+    it and links every partition back into one module, each of which holds
+    the whole program in memory at once.
+
+  Usage: hikari-opt -passes='hikari(enable-bcfobf,enable-cffobf)' \
+             -aesSeed=42 -shards=16 -j8 in.bc -o out.bc
+*/
+#include "include/Obfuscation.h"
+#include "include/Utils.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include <chrono>
+#include <deque>
+#include <optional>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input bitcode>"),
+                                          cl::init("-"));
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"),
+                                           cl::value_desc("filename"),
+                                           cl::init("-"));
+static cl::opt<std::string>
+    Passes("passes", cl::desc("Pipeline run on every partition"),
+           cl::init("hikari"));
+static cl::opt<unsigned>
+    Shards("shards",
+           cl::desc("Number of partitions the module is split into"),
+           cl::init(8));
+static cl::opt<unsigned>
+    Jobs("j",
+         cl::desc("Number of worker processes to run in parallel. 0 uses "
+                  "every hardware thread"),
+         cl::init(0));
+static cl::opt<bool> AllowModulePasses(
+    "allow-module-passes",
+    cl::desc("Run module-level Hikari passes on every partition separately "
+             "instead of refusing them"),
+    cl::init(false));
+static cl::opt<std::string> WorkerInput("worker-input", cl::Hidden,
+                                        cl::init(""));
+static cl::opt<std::string> WorkerOutput("worker-output", cl::Hidden,
+                                         cl::init(""));
+
+static bool writeModule(Module &M, StringRef Path) {
+  std::error_code EC;
+  ToolOutputFile Out(Path, EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << "hikari-opt: " << Path << ": " << EC.message() << "\n";
+    return false;
+  }
+  WriteBitcodeToFile(M, Out.os());
+  Out.keep();
+  return true;
+}
+
+static int runWorker() {
+  LLVMContext Context;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(WorkerInput, Err, Context);
+  if (!M) {
+    Err.print("hikari-opt", errs());
+    return 1;
+  }
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  getHikariPluginInfo().RegisterPassBuilderCallbacks(PB);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  ModulePassManager MPM;
+  if (Error E = PB.parsePassPipeline(MPM, Passes)) {
+    errs() << "hikari-opt: " << toString(std::move(E)) << "\n";
+    return 1;
+  }
+  MPM.run(*M, MAM);
+  return writeModule(*M, WorkerOutput) ? 0 : 1;
+}
+
+// Refuses, or with -allow-module-passes only warns about, module-level passes
+// enabled on the command line or in -passes, as they cannot see the whole
+// module from a partition
+static bool checkModulePasses() {
+  // Parsing the pipeline applies its hikari(...) options here as well
+  PassBuilder PB;
+  getHikariPluginInfo().RegisterPassBuilderCallbacks(PB);
+  ModulePassManager MPM;
+  if (Error E = PB.parsePassPipeline(MPM, Passes)) {
+    errs() << "hikari-opt: " << toString(std::move(E)) << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 8> Enabled;
+  for (StringRef Name : {"enable-allobf", "enable-strcry", "enable-adb",
+                         "enable-antihook", "enable-fco", "enable-acdobf"}) {
+    auto *Opt = static_cast<cl::opt<bool> *>(
+        cl::getRegisteredOptions().lookup(Name));
+    if (Opt && *Opt)
+      Enabled.emplace_back(Name);
+  }
+  if (Enabled.empty())
+    return true;
+  errs() << "hikari-opt: " << (AllowModulePasses ? "warning" : "error")
+         << ": " << join(Enabled, ", ")
+         << " would only see one partition at a time and obfuscate "
+            "differently from a whole-module run";
+  if (!AllowModulePasses)
+    errs() << ", pass -allow-module-passes to run them anyway";
+  errs() << "\n";
+  return AllowModulePasses;
+}
+
+static bool createShardFile(SmallVectorImpl<std::string> &Files, int &FD) {
+  SmallString<128> Path;
+  if (std::error_code EC =
+          sys::fs::createTemporaryFile("hikari-shard", "bc", FD, Path)) {
+    errs() << "hikari-opt: failed to create temporary file: " << EC.message()
+           << "\n";
+    return false;
+  }
+  Files.emplace_back(Path.str());
+  return true;
+}
+
+// Splits the input into Shards partitions and writes them to temporary files.
+// The module is released before any worker starts.
+static bool splitInput(SmallVectorImpl<std::string> &Inputs) {
+  LLVMContext Context;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+  if (!M) {
+    Err.print("hikari-opt", errs());
+    return false;
+  }
+  // llvm.global.annotations ends up in a single partition, so move the
+  // per-function annotations onto the functions before splitting
+  annotation2Metadata(*M);
+  bool Failed = false;
+  SplitModule(
+      *M, Shards,
+      [&](std::unique_ptr<Module> Part) {
+        int FD;
+        if (Failed || !createShardFile(Inputs, FD)) {
+          Failed = true;
+          return;
+        }
+        raw_fd_ostream OS(FD, true);
+        WriteBitcodeToFile(*Part, OS);
+      },
+      /*PreserveLocals=*/true);
+  return !Failed;
+}
+
+static bool runWorkers(const char *Argv0, ArrayRef<std::string> Args,
+                       ArrayRef<std::string> Inputs,
+                       SmallVectorImpl<std::string> &Outputs, uint64_t Seed) {
+  std::string Executable =
+      sys::fs::getMainExecutable(Argv0, (void *)&writeModule);
+  unsigned Parallelism =
+      Jobs ? Jobs : hardware_concurrency().compute_thread_count();
+  std::deque<std::pair<unsigned, sys::ProcessInfo>> Running;
+  bool Failed = false;
+  auto reap = [&]() {
+    auto [Index, PI] = Running.front();
+    Running.pop_front();
+    std::string ErrMsg;
+    sys::ProcessInfo Result = sys::Wait(PI, std::nullopt, &ErrMsg);
+    if (Result.ReturnCode != 0) {
+      errs() << "hikari-opt: partition " << Index << " failed";
+      if (!ErrMsg.empty())
+        errs() << ": " << ErrMsg;
+      errs() << "\n";
+      Failed = true;
+    }
+  };
+  for (unsigned i = 0; i < Inputs.size() && !Failed; i++) {
+    int FD;
+    if (!createShardFile(Outputs, FD)) {
+      Failed = true;
+      break;
+    }
+    sys::Process::SafelyCloseFileDescriptor(FD);
+    // The worker re-parses the original command line, so every Hikari option
+    // given to the driver reaches the passes. The appended -aesSeed wins, so
+    // a seed the driver picked itself is shared by every worker too.
+    std::vector<std::string> WorkerArgs(Args.begin(), Args.end());
+    WorkerArgs.emplace_back("-aesSeed=" + utostr(Seed));
+    WorkerArgs.emplace_back("-hikari_function_seeds");
+    WorkerArgs.emplace_back("-worker-input=" + Inputs[i]);
+    WorkerArgs.emplace_back("-worker-output=" + Outputs[i]);
+    SmallVector<StringRef, 32> WorkerArgRefs(WorkerArgs.begin(),
+                                             WorkerArgs.end());
+    if (Running.size() >= Parallelism)
+      reap();
+    std::string ErrMsg;
+    sys::ProcessInfo PI = sys::ExecuteNoWait(Executable, WorkerArgRefs,
+                                             std::nullopt, {}, 0, &ErrMsg);
+    if (PI.Pid == sys::ProcessInfo::InvalidPid) {
+      errs() << "hikari-opt: failed to start worker: " << ErrMsg << "\n";
+      Failed = true;
+      break;
+    }
+    Running.emplace_back(i, PI);
+  }
+  while (!Running.empty())
+    reap();
+  return !Failed;
+}
+
+// Links the obfuscated partitions in index order, which keeps the output
+// independent of the order the workers finished in
+static bool linkShards(ArrayRef<std::string> Outputs) {
+  LLVMContext Context;
+  std::unique_ptr<Module> Composite;
+  for (const std::string &Path : Outputs) {
+    SMDiagnostic Err;
+    std::unique_ptr<Module> Part = parseIRFile(Path, Err, Context);
+    if (!Part) {
+      Err.print("hikari-opt", errs());
+      return false;
+    }
+    if (!Composite) {
+      Composite = std::move(Part);
+      continue;
+    }
+    if (Linker::linkModules(*Composite, std::move(Part))) {
+      errs() << "hikari-opt: failed to link " << Path << "\n";
+      return false;
+    }
+  }
+  if (verifyModule(*Composite, &errs())) {
+    errs() << "hikari-opt: linked module is broken\n";
+    return false;
+  }
+  return writeModule(*Composite, OutputFilename);
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "Hikari sharded obfuscation driver\n\n"
+      "The random choices made for every function come from a PRNG stream "
+      "derived from -aesSeed and its name, as in a serial run with "
+      "-hikari_function_seeds. Generated per-module globals such as jump "
+      "tables still vary with -shards. Module-level "
+      "passes are refused unless -allow-module-passes is given. Peak memory "
+      "is not reduced, as the input is parsed as a whole to split it and the "
+      "output is linked back into one module.\n");
+  if (!WorkerInput.empty())
+    return runWorker();
+  if (Shards == 0) {
+    errs() << "hikari-opt: -shards must be at least 1\n";
+    return 1;
+  }
+  if (!checkModulePasses())
+    return 1;
+
+  // Reuse the scheduler's own seed option so -aesSeed means the same thing
+  // here as it does under opt or clang
+  auto *AesSeed = static_cast<cl::opt<uint64_t> *>(
+      cl::getRegisteredOptions().lookup("aesSeed"));
+  uint64_t Seed;
+  if (AesSeed && AesSeed->getNumOccurrences()) {
+    Seed = *AesSeed;
+  } else {
+    Seed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+               .count();
+    hikariLog(1) << "hikari-opt: no -aesSeed given, using " << Seed << "\n";
+  }
+
+  SmallVector<std::string, 16> Inputs, Outputs;
+  std::vector<std::string> Args(argv, argv + argc);
+  bool Success = splitInput(Inputs) &&
+                 runWorkers(argv[0], Args, Inputs, Outputs, Seed) &&
+                 linkShards(Outputs);
+  for (const std::string &Path : Inputs)
+    sys::fs::remove(Path);
+  for (const std::string &Path : Outputs)
+    sys::fs::remove(Path);
+  return Success ? 0 : 1;
+}